@@ -315,7 +315,7 @@ for instance in $INSTANCES; do
 		;;
 	esac
 	if [ "$prefix" != "" ]; then
-		ldflagsalways="$ldflagsalways -ltcmalloc -lpthread -lunwind"
+		ldflagsalways="$ldflagsalways -ltcmalloc -lpthread"
 		ldflagsalways="$ldflagsalways -L$prefix/lib -L$PATHAUTOPREFIX/lib"
 		prefixbin="$prefix/bin"
 		prefixlib="$prefix/lib"
@@ -332,6 +332,9 @@ for instance in $INSTANCES; do
 	typesanresid*)
 		blacklist="$PATHROOT/blacklist_all.txt"
 		;;
+	typesanseg)
+		cflags="$cflags -mllvm -typesan-segregate-types"
+		;;
 	esac
 	cflagsff="$cflags"
 	[ "$blacklist" = "" ] || cflags="$cflags -fsanitize-blacklist=$blacklist"
@@ -346,6 +349,7 @@ for instance in $INSTANCES; do
 		echo "export PATH=\"$prefixbin:$PATHAUTOPREFIX/bin:\$PATH\""
 		echo "cd \"$PATHROOT/ubench\""
 		echo "taskset -c 1 ./ubench-$instancename"
+		echo "taskset -c 1 ./dlbench-$instancename"
 	) > "$PATHROOT/run-ubench-$instancename.sh"
 	chmod u+x "$PATHROOT/run-ubench-$instancename.sh"
 
@@ -443,7 +447,7 @@ for instance in $INSTANCES; do
 		{
 			echo "#!/bin/bash"
 			echo "set -e"
-			echo "XARGS=\"$ldflags -lunwind -lstdc++ -lm\""
+			echo "XARGS=\"$ldflags -lstdc++ -lm\""
 			echo "for arg in \"\$@\"; do"
 			echo "  case \"\$arg\" in"
 			echo "  -c|-E|-V)"
@@ -8,9 +8,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <semaphore.h>
 #include <fcntl.h>
 
+// Layout of the metalloc page table and its entries, as emitted inline by
+// the TypeSan passes, shared with the runtime
+#include "../../../../projects/compiler-rt/lib/metalloc/metapagetable_core.h"
+
 using namespace llvm;
 using std::string;
 
@@ -22,69 +25,23 @@ namespace llvm {
 	class Function;
 	class TargetLibraryInfo;
 
+    // Compile-time statistics and class hash names, collected when
+    // TYPECHECK_LOGFILE is set. Every compiler invocation writes a shard of
+    // its own next to the log file on exit; typesan_logmerge.py merges the
+    // shards into it.
     class TypeSanLoggerClass {
+        bool enabled;
         std::map<uint64_t, string> hashMapping;
         unsigned long staticDownCasts = 0;
         unsigned long trackedStack = 0;
         unsigned long trackedGlobal = 0;
         unsigned long trackedHeap = 0;
     public:
-        TypeSanLoggerClass() {
-        }
-        ~TypeSanLoggerClass() {
-            string logFile = "";
-            char *envVariable = getenv("TYPECHECK_LOGFILE");
-            if (envVariable != nullptr) {
-                logFile = envVariable;
-            }
-            if (logFile != "") {
-                sem_t *loggerSemaphore = sem_open("TYPECHECK_LOGGER_SEMAPHORE", O_CREAT, 0600, 1);
-                sem_wait(loggerSemaphore);
-                std::ifstream inputFile(logFile);
-                if (inputFile.is_open()) {
-                    string line;
-                    
-                    std::getline(inputFile, line);
-                    staticDownCasts += stoul(line);
-                    std::getline(inputFile, line);
-                    trackedStack += stoul(line);
-                    std::getline(inputFile, line);
-                    trackedGlobal += stoul(line);
-                    std::getline(inputFile, line);
-                    trackedHeap += stoul(line);
-                    
-                    while(1) {
-                        std::getline(inputFile, line);
-                        // If a line was successfully read
-                        if(inputFile.good()) {
-                            uint64_t hash = (uint64_t)stoul(line);
-                            std::getline(inputFile, line);
-                            hashMapping.insert(std::make_pair(hash, line));
-                        // No valid line read, meaning we reached the end of file
-                        } else {
-                            break;
-                        }
-                    }
-                    
-                    inputFile.close();
-                }
-                std::ofstream outputFile(logFile);
-                outputFile << staticDownCasts << std::endl;
-                outputFile << trackedStack << std::endl;
-                outputFile << trackedGlobal << std::endl;
-                outputFile << trackedHeap << std::endl;
-                for (auto &hashMappingEntry : hashMapping) {
-                    outputFile << hashMappingEntry.first << std::endl;
-                    outputFile << hashMappingEntry.second << std::endl;
-                }
-                outputFile.close();
-                sem_post(loggerSemaphore);
-                sem_close(loggerSemaphore);
-                sem_unlink("TYPECHECK_LOGGER_SEMAPHORE");
-            }
-        }
+        TypeSanLoggerClass();
+        ~TypeSanLoggerClass();
         void addHash(uint64_t hashCode, string &name) {
-            hashMapping.insert(std::make_pair(hashCode, name));
+            if (enabled)
+                hashMapping.insert(std::make_pair(hashCode, name));
         }
         void incStaticDownCast() {
             staticDownCasts++;
@@ -121,8 +78,16 @@ namespace llvm {
 			Constant *MetaPageTable;
                         
 			void insertUpdateMetalloc(Module *SrcM, IRBuilder<> &Builder, Value *ptrValue, Type *allocationType, int alignment, unsigned long count, Value *size, string allocName);
+			void insertAllocProfile(Module *SrcM, IRBuilder<> &Builder, Value *ptrValue, Type *allocationType, Value *size, string allocName);
+			Constant *getAllocationTypeInfo(Module *SrcM, Type *allocationType, unsigned long count);
 			bool interestingType(Type *rootType);
 			static uint64_t getHashCodeFromStruct(StructType *STy);
+			static string getHashNameFromStruct(StructType *STy);
+			static unsigned getStackAlignBits();
+			static void appendToUsed(Module &M, ArrayRef<GlobalValue *> values);
+			static Constant *getObjectHeader(Module &M);
+			static void createSectionTableCtor(Module &M, StringRef section, StringRef registerName, bool passObjectHeader = false,
+					StringRef unregisterName = StringRef());
 
 			const DataLayout &DL;
 
@@ -42,6 +42,7 @@
 #include "llvm/Target/TargetSubtargetInfo.h"
 #include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/TypeSanUtil.h"
 
 using namespace llvm;
 
@@ -96,9 +97,9 @@ class MetaStack : public FunctionPass {
   /// aligned to this value. We need to re-align the unsafe stack if the
   /// alignment of any object on the stack exceeds this value.
   ///
-  /// 16 seems like a reasonable upper bound on the alignment of objects that we
-  /// might expect to appear on the stack on most common targets.
-  enum { StackAlignment = 64 };
+  /// Every tracked object starts on its own metadata granule, so this follows
+  /// the granularity TypeSanPass registers stack metadata with.
+  unsigned StackAlignment;
 
   /// \brief Build a value representing a pointer to the unsafe stack pointer.
   Value *getOrCreateUnsafeStackPtr(IRBuilder<> &IRB, Function &F);
@@ -162,6 +163,7 @@ public:
     IntPtrTy = DL->getIntPtrType(M.getContext());
     Int32Ty = Type::getInt32Ty(M.getContext());
     Int8Ty = Type::getInt8Ty(M.getContext());
+    StackAlignment = 1u << TypeSanUtil::getStackAlignBits();
 
     return false;
   }
@@ -357,6 +359,21 @@ Value *MetaStack::moveStaticAllocasToUnsafeStack(
   int64_t StaticOffset = 0; // Current stack top.
   IRB.SetInsertPoint(BasePointer->getNextNode());
 
+  // Pack the frame: placing the most aligned and largest objects first keeps
+  // the padding between consecutive objects to a minimum.
+  SmallVector<AllocaInst *, 16> SortedAllocas(StaticAllocas.begin(),
+                                              StaticAllocas.end());
+  std::stable_sort(SortedAllocas.begin(), SortedAllocas.end(),
+                   [this](AllocaInst *A, AllocaInst *B) {
+    unsigned AlignA = std::max((unsigned)DL->getPrefTypeAlignment(
+                                   A->getAllocatedType()), A->getAlignment());
+    unsigned AlignB = std::max((unsigned)DL->getPrefTypeAlignment(
+                                   B->getAllocatedType()), B->getAlignment());
+    if (AlignA != AlignB)
+      return AlignA > AlignB;
+    return getStaticAllocaAllocationSize(A) > getStaticAllocaAllocationSize(B);
+  });
+
   for (Argument *Arg : ByValArguments) {
     Type *Ty = Arg->getType()->getPointerElementType();
 
@@ -386,8 +403,25 @@ Value *MetaStack::moveStaticAllocasToUnsafeStack(
     IRB.CreateMemCpy(Off, Arg, Size, Arg->getParamAlignment());
   }
 
+  // Objects TypeSanPass left to a frame template (see metalloc_stamp_frame),
+  // along with their typeinfo and size.
+  DenseMap<AllocaInst *, SmallVector<CallInst *, 1>> FrameObjectCalls;
+  if (Function *FrameObjectFn =
+          F.getParent()->getFunction("metalloc_frame_object")) {
+    for (User *U : FrameObjectFn->users()) {
+      auto CI = dyn_cast<CallInst>(U);
+      if (!CI || CI->getFunction() != &F)
+        continue;
+      if (auto AI =
+              dyn_cast<AllocaInst>(CI->getArgOperand(0)->stripPointerCasts()))
+        FrameObjectCalls[AI].push_back(CI);
+    }
+  }
+  // (offset from BasePointer, typeinfo, size) of each templated object.
+  SmallVector<std::tuple<int64_t, Constant *, uint64_t>, 8> FrameObjects;
+
   // Allocate space for every unsafe static AllocaInst on the unsafe stack.
-  for (AllocaInst *AI : StaticAllocas) {
+  for (AllocaInst *AI : SortedAllocas) {
     IRB.SetInsertPoint(AI);
 
     Type *Ty = AI->getAllocatedType();
@@ -410,6 +444,19 @@ Value *MetaStack::moveStaticAllocasToUnsafeStack(
     if (AI->hasName() && isa<Instruction>(NewAI))
       cast<Instruction>(NewAI)->takeName(AI);
 
+    auto Calls = FrameObjectCalls.find(AI);
+    if (Calls != FrameObjectCalls.end()) {
+      CallInst *CI = Calls->second.front();
+      auto TypeInfo = dyn_cast<Constant>(CI->getArgOperand(1));
+      auto ObjectSize = dyn_cast<ConstantInt>(CI->getArgOperand(2));
+      if (TypeInfo && ObjectSize) {
+        FrameObjects.push_back(
+            std::make_tuple(StaticOffset, TypeInfo, ObjectSize->getZExtValue()));
+        for (CallInst *Call : Calls->second)
+          Call->eraseFromParent();
+      }
+    }
+
     // Replace alloc with the new location.
     replaceDbgDeclareForAlloca(AI, BasePointer, DIB, /*Deref=*/true, -StaticOffset);
     AI->replaceAllUsesWith(NewAI);
@@ -428,6 +475,33 @@ Value *MetaStack::moveStaticAllocasToUnsafeStack(
       IRB.CreateGEP(BasePointer, ConstantInt::get(Int32Ty, -StaticOffset),
                     "tracked_stack_static_top");
   IRB.CreateStore(StaticTop, UnsafeStackPtr);
+
+  // The layout is fixed now, so the metadata of every templated object sits
+  // at a constant granule above the frame bottom. Describe them all in one
+  // constant and let the runtime stamp it with a single page-table lookup.
+  if (!FrameObjects.empty()) {
+    unsigned AlignBits = Log2_32(StackAlignment);
+    SmallVector<Constant *, 16> Template;
+    Template.push_back(ConstantInt::get(IntPtrTy, FrameObjects.size()));
+    for (auto &Object : FrameObjects) {
+      uint64_t Granule = (StaticOffset - std::get<0>(Object)) >> AlignBits;
+      uint64_t Granules = (std::get<2>(Object) + StackAlignment - 1) >> AlignBits;
+      Template.push_back(ConstantInt::get(IntPtrTy, Granule));
+      Template.push_back(ConstantInt::get(IntPtrTy, Granules));
+      Template.push_back(std::get<1>(Object));
+    }
+    ArrayType *TemplateTy = ArrayType::get(IntPtrTy, Template.size());
+    auto TemplateGV = new GlobalVariable(
+        *F.getParent(), TemplateTy, true, GlobalValue::PrivateLinkage,
+        ConstantArray::get(TemplateTy, Template),
+        "__metastack_frame_template");
+    Constant *StampFrame = F.getParent()->getOrInsertFunction(
+        "metalloc_stamp_frame", Type::getVoidTy(F.getContext()), IntPtrTy,
+        IntPtrTy->getPointerTo(), nullptr);
+    IRB.CreateCall(StampFrame,
+                   {IRB.CreatePtrToInt(StaticTop, IntPtrTy),
+                    IRB.CreateConstGEP2_64(TemplateGV, 0, 0)});
+  }
   return StaticTop;
 }
 
@@ -1,5 +1,12 @@
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BlockFrequencyInfoImpl.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
 #include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/CallSite.h"
 #include "llvm/Transforms/Instrumentation.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/InstVisitor.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/MDBuilder.h"
@@ -22,6 +29,9 @@
 #include "llvm/Analysis/ConstantFolding.h"
 #include "llvm/Analysis/MemoryBuiltins.h"
 #include "llvm/Transforms/Utils/TypeSanUtil.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
 
 #include <algorithm>
 #include <iostream>
@@ -41,6 +51,26 @@ using std::string;
 
 typedef std::list<std::pair<long, StructType*> > StructOffsetsTy;
 
+static cl::opt<std::string> ClProfileUse("typesan-profile-use",
+    cl::desc("Cast site profile written with TYPESAN_OPTIONS=profile_path, used to pick the check form of each site"),
+    cl::Hidden, cl::init(""));
+
+static cl::opt<unsigned long long> ClHotSiteCount("typesan-hot-site-count",
+    cl::desc("Executions from which a cast site gets an inline check"),
+    cl::Hidden, cl::init(1000));
+
+// Outcome counts of one cast site, as written by the runtime
+struct CastSiteProfile {
+	uint64_t exec, null, missing, exact, slow, bad;
+};
+
+// How a cast check is emitted. Out-of-line calls are the default; hot sites
+// get the exact-match test inline in front of the call.
+enum CastCheckForm {
+	CastCheckCall,
+	CastCheckInline,
+};
+
 namespace {
 
 	struct TypeSan : public ModulePass {
@@ -67,6 +97,10 @@ namespace {
 
 		Constant *MetaPageTable;
 
+		// Skip metadata for stack objects that cannot reach a cast, unless
+		// TYPECHECK_DISABLE_STACK_OPT is set; read once per module
+		bool stackOpt;
+
                 std::map<Function*, bool> mayCastMap;
                 std::set<Function*> functionsVisitedForMayCast;
                 
@@ -107,6 +141,199 @@ namespace {
 			return false;
 		}
 
+		std::map<uint64_t, CastSiteProfile> castSiteProfiles;
+
+		// Read a profile dumped by the runtime, or merged by
+		// typesan_profile.py. Sites seen more than once are summed.
+		bool loadCastSiteProfile(Module &M) {
+			ErrorOr<std::unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getFile(ClProfileUse);
+			if (!buffer) {
+				M.getContext().emitError("typesan: cannot read cast site profile '" + ClProfileUse + "'");
+				return false;
+			}
+			for (line_iterator line(**buffer, true, '#'); !line.is_at_eof(); ++line) {
+				SmallVector<StringRef, 11> fields;
+				line->split(fields, '\t');
+				uint64_t key, counts[6];
+				if (fields.size() != 11 || fields[0].getAsInteger(16, key)) {
+					continue;
+				}
+				bool valid = true;
+				for (int i = 0; i < 6; ++i) {
+					valid &= !fields[5 + i].getAsInteger(10, counts[i]);
+				}
+				if (!valid) {
+					continue;
+				}
+				CastSiteProfile &profile = castSiteProfiles[key];
+				profile.exec += counts[0];
+				profile.null += counts[1];
+				profile.missing += counts[2];
+				profile.exact += counts[3];
+				profile.slow += counts[4];
+				profile.bad += counts[5];
+			}
+			return true;
+		}
+
+		// Key clang put into the cast site record passed as the last argument
+		static bool getCastSiteKey(CallInst *CI, uint64_t *key) {
+			auto *siteAddr = dyn_cast<ConstantExpr>(CI->getArgOperand(CI->getNumArgOperands() - 1));
+			if (!siteAddr || siteAddr->getOpcode() != Instruction::PtrToInt) {
+				return false;
+			}
+			auto *site = dyn_cast<GlobalVariable>(siteAddr->getOperand(0));
+			if (!site || !site->hasInitializer()) {
+				return false;
+			}
+			auto *record = dyn_cast<ConstantStruct>(site->getInitializer());
+			if (!record || record->getNumOperands() < 3 || !isa<ConstantInt>(record->getOperand(2))) {
+				return false;
+			}
+			*key = cast<ConstantInt>(record->getOperand(2))->getZExtValue();
+			return true;
+		}
+
+		static MDNode *getCastBranchWeights(MDBuilder &MDB, uint64_t taken, uint64_t notTaken) {
+			// Branch weights are 32 bits wide, keep the ratio
+			while (taken >= UINT32_MAX || notTaken >= UINT32_MAX) {
+				taken >>= 1;
+				notTaken >>= 1;
+			}
+			return MDB.createBranchWeights(taken + 1, notTaken + 1);
+		}
+
+		// Form of one site from its TypeSan profile, or from the execution
+		// count -fprofile-instr-use gave its block when the profile has no
+		// data for it
+		CastCheckForm chooseCastCheckForm(CallInst *CI, BlockFrequencyInfo *BFI, const CastSiteProfile **profile) {
+			uint64_t key;
+			*profile = nullptr;
+			if (!castSiteProfiles.empty() && getCastSiteKey(CI, &key)) {
+				auto profileIt = castSiteProfiles.find(key);
+				if (profileIt != castSiteProfiles.end()) {
+					const CastSiteProfile &site = profileIt->second;
+					*profile = &site;
+					if (site.exec < ClHotSiteCount) {
+						return CastCheckCall;
+					}
+					uint64_t fastHits = site.null + site.exact;
+					// Mostly slow-path casts gain nothing from the inline test
+					return fastHits * 2 >= site.exec ? CastCheckInline : CastCheckCall;
+				}
+			}
+			Optional<uint64_t> entryCount = CI->getFunction()->getEntryCount();
+			if (!BFI || !entryCount.hasValue() || BFI->getEntryFreq() == 0) {
+				return CastCheckCall;
+			}
+			double count = (double)entryCount.getValue() *
+				BFI->getBlockFreq(CI->getParent()).getFrequency() / BFI->getEntryFreq();
+			return count >= ClHotSiteCount ? CastCheckInline : CastCheckCall;
+		}
+
+		// Put the exact-match case of the runtime check in front of the call:
+		// a null pointer, or a granule-indexed object starting at the
+		// destination address whose type there is the destination type. Every
+		// other case, including object-indexed heap pages, still goes through
+		// the call. Checks decided inline never reach the runtime, so they
+		// are neither counted by print_stats nor recorded in the profile_path
+		// profile; profiles are best collected from builds without
+		// -typesan-profile-use.
+		void emitInlineCastCheck(CallInst *CI, const CastSiteProfile *profile) {
+			LLVMContext &Ctx = CI->getContext();
+			MDBuilder MDB(Ctx);
+			bool changing = CI->getNumArgOperands() == 4;
+			Value *srcAddr = CI->getArgOperand(0);
+			Value *dstAddr = changing ? CI->getArgOperand(1) : srcAddr;
+			Value *dst = CI->getArgOperand(changing ? 2 : 1);
+
+			BasicBlock *head = CI->getParent();
+			BasicBlock *slow = head->splitBasicBlock(CI, "typesan.check.slow");
+			BasicBlock *cont = slow->splitBasicBlock(CI->getNextNode(), "typesan.check.cont");
+			Function *F = head->getParent();
+			BasicBlock *lookup = BasicBlock::Create(Ctx, "typesan.check.lookup", F, slow);
+			BasicBlock *base = BasicBlock::Create(Ctx, "typesan.check.base", F, slow);
+			BasicBlock *offset = BasicBlock::Create(Ctx, "typesan.check.offset", F, slow);
+			BasicBlock *hash = BasicBlock::Create(Ctx, "typesan.check.hash", F, slow);
+
+			MDNode *nullWeights = nullptr;
+			MDNode *fastWeights = nullptr;
+			MDNode *slowWeights = nullptr;
+			if (profile) {
+				uint64_t slowCount = profile->exec - profile->null - profile->exact;
+				nullWeights = getCastBranchWeights(MDB, profile->null, profile->exec - profile->null);
+				fastWeights = getCastBranchWeights(MDB, profile->exact, slowCount);
+				slowWeights = getCastBranchWeights(MDB, slowCount, profile->exact);
+			}
+
+			head->getTerminator()->eraseFromParent();
+			IRBuilder<> B(head);
+			B.CreateCondBr(B.CreateICmpEQ(srcAddr, ConstantInt::get(Int64Ty, 0)), cont, lookup, nullWeights);
+
+			B.SetInsertPoint(lookup);
+			Value *entryAddr = B.CreateAdd(ConstantInt::get(Int64Ty, METALLOC_PAGETABLE),
+					B.CreateShl(B.CreateLShr(srcAddr, METALLOC_PAGESHIFT), 3));
+			Value *entry = B.CreateLoad(B.CreateIntToPtr(entryAddr, Int64PtrTy));
+			Value *noGranule = B.CreateOr(B.CreateICmpEQ(entry, ConstantInt::get(Int64Ty, 0)),
+					B.CreateICmpNE(B.CreateAnd(entry, METALLOC_OBJECTFLAG), ConstantInt::get(Int64Ty, 0)));
+			B.CreateCondBr(noGranule, slow, base, slowWeights);
+
+			B.SetInsertPoint(base);
+			Value *index = B.CreateLShr(B.CreateAnd(srcAddr, METALLOC_PAGESIZE - 1), B.CreateAnd(entry, METALLOC_ENTRYALIGNMASK));
+			Value *metaAddr = B.CreateAdd(B.CreateLShr(entry, METALLOC_ENTRYBASESHIFT), B.CreateShl(index, METALLOC_METADATASHIFT));
+			Value *metadata = B.CreateIntToPtr(metaAddr, Int64PtrTy);
+			Value *allocBase = B.CreateLoad(metadata);
+			Value *typeInfo = B.CreateLoad(B.CreateConstGEP1_64(metadata, 1));
+			B.CreateCondBr(B.CreateICmpEQ(allocBase, dstAddr), offset, slow, fastWeights);
+
+			// Single objects point past the size field at their first offset,
+			// which is 0; arrays and blacklisted types do not
+			B.SetInsertPoint(offset);
+			Value *typeEntry = B.CreateIntToPtr(typeInfo, Int64PtrTy);
+			B.CreateCondBr(B.CreateICmpEQ(B.CreateLoad(typeEntry), ConstantInt::get(Int64Ty, 0)), hash, slow, fastWeights);
+
+			B.SetInsertPoint(hash);
+			Value *srcHash = B.CreateLoad(B.CreateConstGEP1_64(typeEntry, 1));
+			B.CreateCondBr(B.CreateICmpEQ(srcHash, dst), cont, slow, fastWeights);
+		}
+
+		void placeCastChecks(Function &F) {
+			std::vector<CallInst *> checks;
+			for (Instruction &I : instructions(F)) {
+				CallInst *CI = dyn_cast<CallInst>(&I);
+				Function *callee = CI ? CI->getCalledFunction() : nullptr;
+				if (callee && (callee->getName() == "__type_casting_verification_site" ||
+						callee->getName() == "__changing_type_casting_verification_site")) {
+					checks.push_back(CI);
+				}
+			}
+			if (checks.empty()) {
+				return;
+			}
+			std::unique_ptr<DominatorTree> DT;
+			std::unique_ptr<LoopInfo> LI;
+			std::unique_ptr<BranchProbabilityInfo> BPI;
+			std::unique_ptr<BlockFrequencyInfo> BFI;
+			if (F.getEntryCount().hasValue()) {
+				DT.reset(new DominatorTree(F));
+				LI.reset(new LoopInfo(*DT));
+				BPI.reset(new BranchProbabilityInfo(F, *LI));
+				BFI.reset(new BlockFrequencyInfo(F, *BPI, *LI));
+			}
+			// Decide on all sites before the first one splits its block
+			std::vector<std::pair<CastCheckForm, const CastSiteProfile *> > forms;
+			for (CallInst *CI : checks) {
+				const CastSiteProfile *profile;
+				CastCheckForm form = chooseCastCheckForm(CI, BFI.get(), &profile);
+				forms.push_back(std::make_pair(form, profile));
+			}
+			for (size_t i = 0; i < checks.size(); ++i) {
+				if (forms[i].first == CastCheckInline) {
+					emitInlineCastCheck(checks[i], forms[i].second);
+				}
+			}
+		}
+
                 bool mayCast(Function *F, std::set<Function*> &visited, bool *isComplete) {
                     // Externals may cast
                     if (F->isDeclaration()) {
@@ -164,6 +391,81 @@ namespace {
                     return false;
                 }
 		
+                // Whether the address in V, or a pointer derived from it, can
+                // end up as the operand of a cast check. Follows pointers into
+                // defined callees; anything it cannot follow counts as a yes.
+                bool addressMayReachCast(Value *V, std::set<Value*> &visited) {
+                    // Already being followed elsewhere, that path decides
+                    if (!visited.insert(V).second) {
+                        return false;
+                    }
+                    for (User *U : V->users()) {
+                        // Accesses through the pointer, not of the pointer
+                        if (isa<LoadInst>(U) || isa<ICmpInst>(U)) {
+                            continue;
+                        }
+                        if (StoreInst *SI = dyn_cast<StoreInst>(U)) {
+                            if (SI->getValueOperand() == V) {
+                                return true;
+                            }
+                            continue;
+                        }
+                        // Derived pointers
+                        if (isa<BitCastInst>(U) || isa<AddrSpaceCastInst>(U) ||
+                            isa<GetElementPtrInst>(U) || isa<PHINode>(U) ||
+                            isa<SelectInst>(U)) {
+                            if (addressMayReachCast(U, visited)) {
+                                return true;
+                            }
+                            continue;
+                        }
+                        CallSite CS(U);
+                        if (!CS) {
+                            // Returned, converted to an integer, ...
+                            return true;
+                        }
+                        if (IntrinsicInst *II = dyn_cast<IntrinsicInst>(U)) {
+                            switch (II->getIntrinsicID()) {
+                            case Intrinsic::dbg_declare:
+                            case Intrinsic::dbg_value:
+                            case Intrinsic::lifetime_start:
+                            case Intrinsic::lifetime_end:
+                            case Intrinsic::memcpy:
+                            case Intrinsic::memmove:
+                            case Intrinsic::memset:
+                                continue;
+                            default:
+                                return true;
+                            }
+                        }
+                        // Passed by value, callees only ever see their own copy
+                        bool onlyByVal = CS.getCalledValue() != V;
+                        for (unsigned i = 0, e = CS.arg_size(); i != e; ++i) {
+                            if (CS.getArgument(i) == V && !CS.isByValArgument(i)) {
+                                onlyByVal = false;
+                            }
+                        }
+                        if (onlyByVal) {
+                            continue;
+                        }
+                        // Cast checks are calls to declarations, so only
+                        // bodies we can see and that cannot be replaced at
+                        // link time are followed
+                        Function *callee = CS.getCalledFunction();
+                        if (!callee || callee->isDeclaration() || callee->mayBeOverridden() ||
+                            callee->isVarArg() || CS.getCalledValue() == V) {
+                            return true;
+                        }
+                        Function::arg_iterator formal = callee->arg_begin();
+                        for (unsigned i = 0, e = CS.arg_size(); i != e; ++i, ++formal) {
+                            if (CS.getArgument(i) == V && addressMayReachCast(&*formal, visited)) {
+                                return true;
+                            }
+                        }
+                    }
+                    return false;
+                }
+
 		virtual bool runOnModule(Module &M) {
 
 			Module *SrcM = &M;
@@ -173,6 +475,7 @@ namespace {
 			DL = &SrcM->getDataLayout();
                         
                         CG = &getAnalysis<CallGraphWrapperPass>().getCallGraph();
+			stackOpt = getenv("TYPECHECK_DISABLE_STACK_OPT") == nullptr;
                         
 			TypeSanUtil TypeUtil(*DL);
 
@@ -185,7 +488,7 @@ namespace {
 			TypeUtil.Int32Ty = Type::getInt32Ty(Ctx);
   
 			TypeUtil.MetadataTy = ArrayType::get(TypeUtil.Int64Ty, 2);
-			TypeUtil.MetaPageTable = ConstantInt::get(TypeUtil.Int64Ty, 0x400000000000);
+			TypeUtil.MetaPageTable = ConstantInt::get(TypeUtil.Int64Ty, METALLOC_PAGETABLE);
                         
 			TargetLibraryInfoImpl tlii;
 			TLI = new TargetLibraryInfo(tlii);
@@ -209,20 +512,14 @@ namespace {
 
 			MetadataTy = ArrayType::get(Int64Ty, 2);                      
 
-			Function *FGlobal = Function::Create(VoidFTy, GlobalValue::InternalLinkage,
-					"__init_global_object" + M.getName(), SrcM);
-
-			FGlobal->setUnnamedAddr(true);
-			FGlobal->setLinkage(GlobalValue::InternalLinkage);
-			FGlobal->addFnAttr(Attribute::NoInline);
-
-			BasicBlock *BBGlobal = BasicBlock::Create(Ctx, "entry", FGlobal);
-			IRBuilder<> BuilderGlobal(BBGlobal);
-
 			std::list<GlobalVariable *> trackedGlobals;
+			bool hasCastSites = false;
 
 			// Find interesting globalvariables
 			for (GlobalVariable &GV : M.globals()) {
+				if (GV.getSection() == "typesan_sites") {
+					hasCastSites = true;
+				}
 				if (GV.getName() == "llvm.global_ctors" ||
 					GV.getName() == "llvm.global_dtors" ||
 					GV.getName() == "llvm.global.annotations" ||
@@ -234,29 +531,128 @@ namespace {
 				}
 			}
 
-			if (trackedGlobals.size() > 0) {
-                            Function *FMGlobal = (Function*)M.getOrInsertFunction("metalloc_init_globals", VoidTy, Int64Ty, nullptr);
-                            Value *FMGlobalParam[1] = { BuilderGlobal.CreatePtrToInt(*(trackedGlobals.begin()), Int64Ty) };
-                            BuilderGlobal.CreateCall(FMGlobal, FMGlobalParam);
-                        }
-			
-			// To save globalvariable information
+			// Globals are described by (address, size, typeinfo) records in the
+			// typesan_globals section, which the runtime applies once per DSO.
+			// Only anonymous types, which have no typeinfo constant, still get
+			// their metadata written by the module constructor. Thread-local
+			// globals have no address to record; every thread describes its own
+			// copies instead, through a function the runtime runs per thread.
+			StructType *GlobalRecordTy = StructType::get(Int64Ty, Int64Ty, Int64Ty, nullptr);
+			std::vector<Constant *> globalRecords;
+			std::list<GlobalVariable *> inlineGlobals;
+			std::list<std::pair<GlobalVariable *, Constant *>> threadGlobals;
 			for (GlobalVariable *GV : trackedGlobals) {
-                                        TypeSanLogger.incTrackedGlobal();
+				TypeSanLogger.incTrackedGlobal();
+				Constant *globalSize = ConstantInt::get(Int64Ty, DL->getTypeAllocSize(GV->getValueType()));
+				if (GV->isThreadLocal()) {
+					if (Constant *typeInfo = TypeUtil.getAllocationTypeInfo(SrcM, GV->getValueType(), 1)) {
+						threadGlobals.push_back(std::make_pair(GV, typeInfo));
+					}
+				} else if (Constant *typeInfo = TypeUtil.getAllocationTypeInfo(SrcM, GV->getValueType(), 1)) {
+					globalRecords.push_back(ConstantStruct::get(GlobalRecordTy,
+						ConstantExpr::getPtrToInt(GV, Int64Ty), globalSize, typeInfo, nullptr));
+				} else {
+					inlineGlobals.push_back(GV);
+				}
+			}
+
+			if (!globalRecords.empty()) {
+				ArrayType *GlobalTableTy = ArrayType::get(GlobalRecordTy, globalRecords.size());
+				GlobalVariable *globalTable = new GlobalVariable(M, GlobalTableTy, true,
+						GlobalValue::PrivateLinkage, ConstantArray::get(GlobalTableTy, globalRecords),
+						"__typesan_globals");
+				globalTable->setSection("typesan_globals");
+				globalTable->setAlignment(8);
+				TypeSanUtil::appendToUsed(M, {globalTable});
+				TypeSanUtil::createSectionTableCtor(M, "typesan_globals", "metalloc_register_globals", true);
+			}
+
+			// Cast site records emitted by clang are numbered once per DSO
+			if (hasCastSites) {
+				TypeSanUtil::createSectionTableCtor(M, "typesan_sites", "__typesan_register_sites");
+			}
+
+			if (!inlineGlobals.empty()) {
+				Function *FGlobal = Function::Create(VoidFTy, GlobalValue::InternalLinkage,
+						"__init_global_object" + M.getName(), SrcM);
+
+				FGlobal->setUnnamedAddr(true);
+				FGlobal->setLinkage(GlobalValue::InternalLinkage);
+				FGlobal->addFnAttr(Attribute::NoInline);
+
+				BasicBlock *BBGlobal = BasicBlock::Create(Ctx, "entry", FGlobal);
+				IRBuilder<> BuilderGlobal(BBGlobal);
+
+				// Only writable segments get metadata when the object is registered
+				Constant *objectHeader = TypeSanUtil::getObjectHeader(M);
+				Function *FMGlobal = (Function*)M.getOrInsertFunction("metalloc_register_object", Type::getVoidTy(Ctx), Int8PtrTy, nullptr);
+				BuilderGlobal.CreateCall(FMGlobal, {objectHeader});
+				Function *FMSegment = (Function*)M.getOrInsertFunction("metalloc_register_global_segment", Type::getVoidTy(Ctx), Int8PtrTy, Int64Ty, nullptr);
+				for (GlobalVariable *GV : inlineGlobals) {
+					if (GV->isConstant()) {
+						BuilderGlobal.CreateCall(FMSegment, {objectHeader, BuilderGlobal.CreatePtrToInt(GV, Int64Ty)});
+					}
+				}
+
+				// To save globalvariable information
+				for (GlobalVariable *GV : inlineGlobals) {
 					string allocName = "global:" + GV->getName().str();
 					TypeUtil.insertUpdateMetalloc(SrcM, BuilderGlobal, GV, GV->getValueType(), 3, 1, ConstantInt::get(Int64Ty, DL->getTypeAllocSize(GV->getValueType())), allocName);
+				}
+
+				BuilderGlobal.CreateRetVoid();
+
+				// to insert into GlobalCtor
+				appendToGlobalCtors(M, FGlobal, 0);
 			}
 
-			BuilderGlobal.CreateRetVoid();
+			if (!threadGlobals.empty()) {
+				Function *FThread = Function::Create(VoidFTy, GlobalValue::InternalLinkage,
+						"__init_thread_globals" + M.getName(), SrcM);
+				FThread->addFnAttr(Attribute::NoInline);
+				IRBuilder<> BuilderThread(BasicBlock::Create(Ctx, "entry", FThread));
+				Function *FMThreadGlobal = (Function*)M.getOrInsertFunction("metalloc_thread_global", Type::getVoidTy(Ctx),
+						Int8PtrTy, Int64Ty, Int64Ty, nullptr);
+				for (auto &threadGlobal : threadGlobals) {
+					GlobalVariable *GV = threadGlobal.first;
+					BuilderThread.CreateCall(FMThreadGlobal, {BuilderThread.CreatePointerCast(GV, Int8PtrTy),
+						ConstantInt::get(Int64Ty, DL->getTypeAllocSize(GV->getValueType())), threadGlobal.second});
+				}
+				BuilderThread.CreateRetVoid();
+
+				// Runs FThread for the current thread and every thread started later
+				Function *FThreadCtor = Function::Create(VoidFTy, GlobalValue::InternalLinkage,
+						"__register_thread_globals" + M.getName(), SrcM);
+				IRBuilder<> BuilderThreadCtor(BasicBlock::Create(Ctx, "entry", FThreadCtor));
+				Function *FMRegisterThread = (Function*)M.getOrInsertFunction("metalloc_register_thread_globals", Type::getVoidTy(Ctx),
+						Int8PtrTy, Int8PtrTy, nullptr);
+				BuilderThreadCtor.CreateCall(FMRegisterThread, {BuilderThreadCtor.CreatePointerCast(FThread, Int8PtrTy),
+					TypeSanUtil::getObjectHeader(M)});
+				BuilderThreadCtor.CreateRetVoid();
+				appendToGlobalCtors(M, FThreadCtor, 0);
+			}
 
-			// to insert into GlobalCtor
-			appendToGlobalCtors(M, FGlobal, 0);
+			// Tell the runtime which granularity the tracked stacks use. The
+			// definition is strong but lives in a comdat named after the value:
+			// objects agreeing on it keep a single copy, while objects built with
+			// different values keep both and fail to link with a duplicate symbol.
+			unsigned stackAlignBits = TypeSanUtil::getStackAlignBits();
+			if (!M.getNamedValue("__metastack_align_bits")) {
+				GlobalVariable *alignBitsGV = new GlobalVariable(M, Int32Ty, true,
+						GlobalValue::ExternalLinkage, ConstantInt::get(Int32Ty, stackAlignBits),
+						"__metastack_align_bits");
+				alignBitsGV->setComdat(M.getOrInsertComdat("__metastack_align_bits." + std::to_string(stackAlignBits)));
+			}
 
+			// Functions generated above are not in the call graph and only
+			// describe metadata
 			for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F) {
-				if (F->empty() || F->getEntryBlock().empty() || F->getName().startswith("__init_global_object")) {
+				if (F->empty() || F->getEntryBlock().empty() || F->getName().startswith("__init_global_object") ||
+					F->getName().startswith("__init_thread_globals") || F->getName().startswith("__register_thread_globals") ||
+					F->getName().startswith("__typesan_register_") || F->getName().startswith("__typesan_unregister_")) {
 					continue;
 				}
-				if (getenv("TYPECHECK_DISABLE_STACK_OPT") == nullptr) {
+				if (stackOpt) {
 					std::set<Function*> visitedFunctions;
 					bool tmp;
 					bool mayCurrentCast = mayCast(&*F, visitedFunctions, &tmp);
@@ -268,12 +664,23 @@ namespace {
 				}
 				for (auto &a : F->args()) {
 					Argument *Arg = dyn_cast<Argument>(&a);
-					if (!Arg->hasByValAttr()) {
+					if (!Arg->hasByValAttr() || F->hasFnAttribute("typesan-no-stack-metadata")) {
 						continue;
 					}
 					Type *ArgPointedTy = Arg->getType()->getPointerElementType();
-					if (TypeUtil.interestingType(ArgPointedTy)) {
-						unsigned long size = DL->getTypeStoreSize(ArgPointedTy);
+					if (!TypeUtil.interestingType(ArgPointedTy)) {
+						continue;
+					}
+					// The caller's copy lives on the regular stack, so tracking
+					// needs a copy of our own, but only if the address can
+					// actually reach a cast
+					if (stackOpt) {
+						std::set<Value*> visitedValues;
+						if (!addressMayReachCast(Arg, visitedValues)) {
+							continue;
+						}
+					}
+					unsigned long size = DL->getTypeStoreSize(ArgPointedTy);
                                                 IRBuilder<> B(&*(F->getEntryBlock().getFirstInsertionPt()));
                                                 Value *NewAlloca = B.CreateAlloca(ArgPointedTy);
                                                 Arg->replaceAllUsesWith(NewAlloca);
@@ -282,7 +689,6 @@ namespace {
                                                 Value *Param[5] = { Dst, Src, ConstantInt::get(Int64Ty, size), 
                                                         ConstantInt::get(Int32Ty, 1), ConstantInt::get(Int1Ty, 0) };
                                                 B.CreateCall(MemcpyFunc, Param);
-					}
 				}
 				std::list<AllocaInst *> trackedAllocas;
 				for (Function::iterator BB = F->begin(), E = F->end(); BB != E; ++BB) {
@@ -293,13 +699,49 @@ namespace {
 						IRBuilder<> Builder(&*i);
 
 						if (AllocaInst *AI = dyn_cast<AllocaInst>(&*i)) {
-							if (TypeUtil.interestingType(AI->getAllocatedType())) {
-								trackedAllocas.push_back(AI);
+							if (!TypeUtil.interestingType(AI->getAllocatedType())) {
+								continue;
+							}
+							// Functions blacklisted with fun:<name>=metadata keep
+							// their objects on the regular stack
+							if (F->hasFnAttribute("typesan-no-stack-metadata")) {
+								continue;
+							}
+							// Objects whose address never reaches a cast
+							// stay on the regular stack
+							if (stackOpt) {
+								std::set<Value*> visitedValues;
+								if (!addressMayReachCast(AI, visitedValues)) {
+									continue;
+								}
 							}
+							trackedAllocas.push_back(AI);
 						}
 					}
 				}
 
+				// Fixed-size objects of frames with several of them are
+				// described to MetaStack, which stamps the whole frame at once
+				// from a per-function template instead of one page-table
+				// lookup and store sequence per object
+				std::map<AllocaInst *, Constant *> frameObjects;
+				for (AllocaInst *AI : trackedAllocas) {
+					ConstantInt *constantSize = dyn_cast<ConstantInt>(AI->getArraySize());
+					if (!AI->isStaticAlloca() || !constantSize) {
+						continue;
+					}
+					if (Constant *typeInfo = TypeUtil.getAllocationTypeInfo(SrcM, AI->getAllocatedType(), constantSize->getZExtValue())) {
+						frameObjects.insert(std::make_pair(AI, typeInfo));
+					}
+				}
+				if (frameObjects.size() < 2) {
+					frameObjects.clear();
+				}
+				Function *FrameObjectFunc = nullptr;
+				if (!frameObjects.empty()) {
+					FrameObjectFunc = (Function*)M.getOrInsertFunction("metalloc_frame_object", Type::getVoidTy(Ctx), Int8PtrTy, Int64Ty, Int64Ty, nullptr);
+				}
+
 				int index = 0;
 				Function *index_func = nullptr;
 				for (AllocaInst *AI : trackedAllocas) {
@@ -317,17 +759,38 @@ namespace {
                                                 TypeSanLogger.incTrackedStack();
 						MDNode *node = MDNode::get(Ctx, MDString::get(Ctx, "trackedalloca"));
 						AI->setMetadata("TrackedAlloca", node);
-                        if (ConstantInt *constantSize = dyn_cast<ConstantInt>(AI->getArraySize())) {
-    						TypeUtil.insertUpdateMetalloc(SrcM, Builder, AI, AI->getAllocatedType(), 6, constantSize->getZExtValue(), 
-                                ConstantExpr::getMul(ConstantInt::get(Int64Ty, constantSize->getZExtValue()), ConstantInt::get(Int64Ty, DL->getTypeAllocSize(AI->getAllocatedType()))), allocName);
+						auto frameObject = frameObjects.find(AI);
+						Value *allocSize;
+						if (frameObject != frameObjects.end()) {
+							uint64_t size = DL->getTypeAllocSize(AI->getAllocatedType()) * cast<ConstantInt>(AI->getArraySize())->getZExtValue();
+							allocSize = ConstantInt::get(Int64Ty, size);
+							Value *Param[3] = { Builder.CreatePointerCast(AI, Int8PtrTy), frameObject->second, allocSize };
+							Builder.CreateCall(FrameObjectFunc, Param);
+						} else if (ConstantInt *constantSize = dyn_cast<ConstantInt>(AI->getArraySize())) {
+							allocSize = ConstantExpr::getMul(ConstantInt::get(Int64Ty, constantSize->getZExtValue()), ConstantInt::get(Int64Ty, DL->getTypeAllocSize(AI->getAllocatedType())));
+    						TypeUtil.insertUpdateMetalloc(SrcM, Builder, AI, AI->getAllocatedType(), stackAlignBits, constantSize->getZExtValue(), 
+                                allocSize, allocName);
                         } else {
                         			Value *arraySize = AI->getArraySize();
                         			if (arraySize->getType() != Int64Ty) {
 							arraySize = Builder.CreateIntCast(arraySize, Int64Ty, false);
                         			}
-    						TypeUtil.insertUpdateMetalloc(SrcM, Builder, AI, AI->getAllocatedType(), 6, 0, 
-                                Builder.CreateMul(arraySize, ConstantInt::get(Int64Ty, DL->getTypeAllocSize(AI->getAllocatedType()))), allocName);
+							allocSize = Builder.CreateMul(arraySize, ConstantInt::get(Int64Ty, DL->getTypeAllocSize(AI->getAllocatedType())));
+    						TypeUtil.insertUpdateMetalloc(SrcM, Builder, AI, AI->getAllocatedType(), stackAlignBits, 0, 
+                                allocSize, allocName);
                         }
+						TypeUtil.insertAllocProfile(SrcM, Builder, AI, AI->getAllocatedType(), allocSize, allocName);
+					}
+				}
+			}
+
+			// Pick the form of each cast check once the profile says which
+			// sites are hot, or -fprofile-instr-use left execution counts
+			castSiteProfiles.clear();
+			if (ClProfileUse.empty() || loadCastSiteProfile(M)) {
+				for (Function &F : M) {
+					if (!F.isDeclaration()) {
+						placeCastChecks(F);
 					}
 				}
 			}
@@ -1,4 +1,5 @@
 #include "llvm/Transforms/Instrumentation.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/IR/InstVisitor.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/MDBuilder.h"
@@ -20,6 +21,8 @@
 #include "llvm/IR/Constants.h"
 #include "llvm/Analysis/ConstantFolding.h"
 #include "llvm/Analysis/MemoryBuiltins.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Transforms/Utils/TypeSanUtil.h"
 
 #include <algorithm>
@@ -35,6 +38,14 @@
 using namespace llvm;
 using std::string;
 
+static cl::opt<bool> ClSegregateTypes("typesan-segregate-types",
+    cl::desc("Serve tracked single-object new/delete from type-stable per-type caches"),
+    cl::Hidden, cl::init(false));
+
+static cl::list<std::string> ClSegregateTypeNames("typesan-segregate-type",
+    cl::desc("Restrict -typesan-segregate-types to the given type (IR struct name)"),
+    cl::Hidden, cl::ZeroOrMore);
+
 namespace {
 
 	struct TypeSanTree : public ModulePass {
@@ -150,6 +161,59 @@ namespace {
 
                 }
 
+                bool isSegregatedType(Type *Ty) {
+                        StructType *STy = dyn_cast<StructType>(Ty);
+                        if (!ClSegregateTypes || !STy || STy->isLiteral() || STy->isOpaque() || !STy->getName().startswith("trackedtype.")) {
+                                return false;
+                        }
+                        if (ClSegregateTypeNames.empty()) {
+                                return true;
+                        }
+                        return std::find(ClSegregateTypeNames.begin(), ClSegregateTypeNames.end(), STy->getName().str()) != ClSegregateTypeNames.end();
+                }
+
+                // Thread-local (head, count, next) cache shared by all modules allocating
+                // the type, see struct metalloc_typed_pool
+                GlobalVariable *getTypedPool(Module *SrcM, StructType *STy) {
+                        string poolName = "__metalloc_typed_pool." + STy->getName().str();
+                        if (GlobalVariable *pool = SrcM->getNamedGlobal(poolName)) {
+                                return pool;
+                        }
+                        ArrayType *PoolTy = ArrayType::get(Int64Ty, 3);
+                        GlobalVariable *pool = new GlobalVariable(*SrcM, PoolTy, false, GlobalValue::LinkOnceODRLinkage,
+                                                ConstantAggregateZero::get(PoolTy), poolName, nullptr, GlobalValue::GeneralDynamicTLSModel);
+                        pool->setComdat(SrcM->getOrInsertComdat(poolName));
+                        return pool;
+                }
+
+                // Replace an allocation call by a metalloc typed-allocation entry point,
+                // which writes the final metadata in the same pass as the allocation
+                void redirectTypedAllocation(Module *SrcM, CallInst *call, StringRef typedName, Constant *typeInfo, GlobalVariable *pool) {
+                        IRBuilder<> Builder(call);
+                        std::vector<Value*> Param = {call->getArgOperand(0), typeInfo};
+                        std::vector<Type*> ParamTy = {Int64Ty, Int64Ty};
+                        if (pool != nullptr) {
+                                Param.push_back(Builder.CreatePointerCast(pool, Int64PtrTy));
+                                ParamTy.push_back(Int64PtrTy);
+                        }
+                        Constant *TypedAlloc = SrcM->getOrInsertFunction(typedName, FunctionType::get(Int8PtrTy, ParamTy, false));
+                        CallInst *typedCall = Builder.CreateCall(TypedAlloc, Param);
+                        typedCall->setDebugLoc(call->getDebugLoc());
+                        call->replaceAllUsesWith(typedCall);
+                        call->eraseFromParent();
+                }
+
+                void redirectSegregatedDelete(Module *SrcM, TypeSanUtil &TypeUtil, CallInst *call, StructType *STy) {
+                        IRBuilder<> Builder(call);
+                        Constant *TypedDelete = SrcM->getOrInsertFunction("metalloc_typed_pool_delete", Type::getVoidTy(SrcM->getContext()),
+                                                                          Int8PtrTy, Int64Ty, Int64Ty, Int64PtrTy, nullptr);
+                        Value *Param[4] = {call->getArgOperand(0), ConstantInt::get(Int64Ty, DL->getTypeAllocSize(STy)),
+                                           TypeUtil.getAllocationTypeInfo(SrcM, STy, 1), Builder.CreatePointerCast(getTypedPool(SrcM, STy), Int64PtrTy)};
+                        CallInst *typedCall = Builder.CreateCall(TypedDelete, Param);
+                        typedCall->setDebugLoc(call->getDebugLoc());
+                        call->eraseFromParent();
+                }
+
                 Instruction* findNextInstruction(Instruction *inst) {
                         BasicBlock::iterator it(inst);
                         ++it;
@@ -221,15 +285,9 @@ namespace {
 
                         Module *SrcM;
                         SrcM = &M;
-			size_t found;
 
                         LLVMContext& Ctx = M.getContext();
 
-			string mname = M.getName();
-
-                        found=mname.find('.');
-			mname.erase(found);
-
 			DL = &SrcM->getDataLayout();
 
 			TypeSanUtil TypeUtil(*DL);
@@ -243,7 +301,7 @@ namespace {
 			TypeUtil.Int32Ty = Type::getInt32Ty(Ctx);
   
 			TypeUtil.MetadataTy = ArrayType::get(TypeUtil.Int64Ty, 2);
-			TypeUtil.MetaPageTable = ConstantInt::get(TypeUtil.Int64Ty, 0x400000000000);                       
+			TypeUtil.MetaPageTable = ConstantInt::get(TypeUtil.Int64Ty, METALLOC_PAGETABLE);                       
                         
 			std::vector<StructType*> StructTypes;
 		        std::vector<StructType*> Types =  SrcM->getIdentifiedStructTypes();
@@ -262,6 +320,7 @@ namespace {
 			this->tli = &(getAnalysisIfAvailable<TargetLibraryInfoWrapperPass>()->getTLI());
 
 			std::map<CallInst *, Type *> heapObjsFree, heapObjsNew;
+			std::list<CallInst *> placementNews;
 
 			for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F) {
 				int index = 0;
@@ -275,6 +334,10 @@ namespace {
 							if (call->getCalledFunction() != nullptr) {
 								functionName = call->getCalledFunction()->getName();
 							}
+							if (functionName == "__typesan_placement_new") {
+								placementNews.push_back(call);
+								continue;
+							}
 							int unmangledStatus;
 							char *unmangledName = abi::__cxa_demangle(functionName.c_str(), nullptr, nullptr, &unmangledStatus);
 							if (unmangledStatus == 0) {
@@ -293,6 +356,21 @@ namespace {
 									}
 								}
 							}
+							// Plain deletes of segregated types return the object to its type cache;
+							// the static type matches the dynamic one for well-defined deletes.
+							// Sized deletes of anything but one object, such as container
+							// buffers, keep going to operator delete; unsized ones are sorted
+							// out by the runtime from the size of the block.
+							if ((functionName == "_ZdlPv" || functionName == "_ZdlPvm") && call->getCalledFunction()->isDeclaration()) {
+								Type *deleteTy = call->getArgOperand(0)->stripPointerCasts()->getType()->getPointerElementType();
+								if (isSegregatedType(deleteTy)) {
+									ConstantInt *deleteSize = functionName == "_ZdlPvm" ? dyn_cast<ConstantInt>(call->getArgOperand(1)) : nullptr;
+									if (functionName == "_ZdlPv" ||
+										(deleteSize && deleteSize->getZExtValue() == DL->getTypeAllocSize(deleteTy))) {
+										heapObjsFree.insert(std::pair<CallInst *, Type *>(call, deleteTy));
+									}
+								}
+							}
 						}
 					}
 						
@@ -303,6 +381,10 @@ namespace {
 
 						{
                                                         TypeSanLogger.incTrackedHeap();
+							string allocName = "heap:" + F->getName().str() + ":" + std::to_string(index++) + ":";
+							if (it->first->getCalledFunction() != nullptr) {
+								allocName += it->first->getCalledFunction()->getName();
+							}
 							Value *Size;
 							unsigned long count = 0;
                             IRBuilder<> PreAllocBuilder(it->first);
@@ -317,21 +399,66 @@ namespace {
 								} else {
 									count = 0;
 								}
+								TypeUtil.insertAllocProfile(SrcM, Builder, it->first, it->second, Size, allocName);
+								// Global operator new of a segregated type is served from its type cache.
+								// Allocators this module defines itself are left alone; ones replaced
+								// elsewhere in the link are detected by the runtime.
+								Function *callee = it->first->getCalledFunction();
+								StringRef calleeName = (callee != nullptr && callee->isDeclaration()) ? callee->getName() : StringRef();
+								if (count == 1 && calleeName == "_Znwm" && isSegregatedType(it->second)) {
+									redirectTypedAllocation(SrcM, it->first, "metalloc_typed_pool_new", TypeUtil.getAllocationTypeInfo(SrcM, it->second, 1),
+										getTypedPool(SrcM, cast<StructType>(it->second)));
+									continue;
+								}
+								// Standard allocators are replaced by the fused typed-allocation entry points
+								StringRef typedName = StringSwitch<StringRef>(calleeName)
+									.Cases("_Znwm", "_Znam", "metalloc_typed_new")
+									.Case("malloc", "metalloc_typed_malloc")
+									.Default(StringRef());
+								if (!typedName.empty()) {
+									if (Constant *typeInfo = TypeUtil.getAllocationTypeInfo(SrcM, it->second, count)) {
+										redirectTypedAllocation(SrcM, it->first, typedName, typeInfo, nullptr);
+										continue;
+									}
+								}
 							} else if (isCallocLikeFn(it->first, this->tli)) {
 								Value *NElems = it->first->getArgOperand(0);
 								Value *ElemSize = it->first->getArgOperand(1);
                                 Size = Builder.CreateMul(NElems, ElemSize);
+								TypeUtil.insertAllocProfile(SrcM, Builder, it->first, it->second, Size, allocName);
 							} else {
 								assert(0 && "Unknown allocation type");
 							}
 
-							string allocName = "heap:" + F->getName().str() + ":" + std::to_string(index++) + ":";
-							if (it->first->getCalledFunction() != nullptr) {
-								allocName += it->first->getCalledFunction()->getName();
-							}
 							TypeUtil.insertUpdateMetalloc(SrcM, Builder, (Value *)(it->first), it->second, 0, count, Size, allocName);
 						}
 					}
+
+					for (auto &freeEntry : heapObjsFree) {
+						redirectSegregatedDelete(SrcM, TypeUtil, freeEntry.first, cast<StructType>(freeEntry.second));
+					}
+					// Objects placed into memory from custom allocators, announced by clang
+					// with the element type as the null third operand
+					for (CallInst *call : placementNews) {
+						Type *allocTy = call->getArgOperand(2)->getType()->getPointerElementType();
+						Constant *typeInfo = nullptr;
+						if (TypeUtil.interestingType(allocTy)) {
+							typeInfo = TypeUtil.getAllocationTypeInfo(SrcM, allocTy, 0);
+						}
+						if (typeInfo != nullptr) {
+							TypeSanLogger.incTrackedHeap();
+							IRBuilder<> Builder(call);
+							Function *RegisterFunc = (Function*)SrcM->getOrInsertFunction("__typesan_register_object", Type::getVoidTy(Ctx),
+								Int8PtrTy, Int64Ty, Int64Ty, nullptr);
+							Value *Param[3] = {call->getArgOperand(0), typeInfo, call->getArgOperand(1)};
+							CallInst *registerCall = Builder.CreateCall(RegisterFunc, Param);
+							registerCall->setDebugLoc(call->getDebugLoc());
+						}
+						call->eraseFromParent();
+					}
+					heapObjsNew.clear();
+					heapObjsFree.clear();
+					placementNews.clear();
 				}
 			}
 
@@ -356,8 +483,12 @@ namespace {
 			//Insert class's parent information using global variable 
 			/////////////////////////////////////////////////////////
 
-                        int classCount = 0;
-                        std::vector<Constant*> infoElems;
+                        // Every class entry becomes its own COMDAT record in the
+                        // typesan_cinfo section, named after its contents, so the
+                        // linker keeps one copy of each distinct entry per DSO.
+                        // The runtime merges the section lazily.
+                        std::vector<GlobalValue *> infoEntries;
+                        std::vector<GlobalValue *> nameEntries;
                         for (auto &infoEntry : classInfoMap) {
                             // No support for anonymous structs yet
                             if (infoEntry.first->isLiteral()) {
@@ -368,62 +499,89 @@ namespace {
                             if (!infoEntry.first->getName().startswith("trackedtype.") || infoEntry.first->getName().endswith(".base")) {
                                 continue;
                             }
-                            classCount++;
-                            infoElems.push_back(ConstantInt::get(Int64Ty, infoEntry.second->parentHashes.size() + 1));
-                            infoElems.push_back(ConstantInt::get(Int64Ty, infoEntry.second->classHash));
+                            std::vector<uint64_t> infoElems;
+                            infoElems.push_back(infoEntry.second->parentHashes.size() + 1);
+                            infoElems.push_back(infoEntry.second->classHash);
                             for (uint64_t hash : infoEntry.second->parentHashes) {
-                                infoElems.push_back(ConstantInt::get(Int64Ty, hash));
+                                infoElems.push_back(hash);
                             }
+                            emitClassInfoEntry(M, infoElems, infoEntries);
+                            emitTypeNameEntry(M, infoEntry.second->classHash,
+                                TypeSanUtil::getHashNameFromStruct(infoEntry.first), nameEntries);
                             if (infoEntry.second->fakeParentHashes.size() > 0) {
-                                // New entry for the same class, increase number of "classes"
-                                classCount++;
-                                infoElems.push_back(ConstantInt::get(Int64Ty, (1 << 31) | (infoEntry.second->fakeParentHashes.size() + 1)));
-                                infoElems.push_back(ConstantInt::get(Int64Ty, infoEntry.second->classHash));
+                                // New entry for the same class, flagged for merging
+                                infoElems.clear();
+                                infoElems.push_back((1 << 31) | (infoEntry.second->fakeParentHashes.size() + 1));
+                                infoElems.push_back(infoEntry.second->classHash);
                                 for (uint64_t hash : infoEntry.second->fakeParentHashes) {
-                                    infoElems.push_back(ConstantInt::get(Int64Ty, hash));
+                                    infoElems.push_back(hash);
                                 }
+                                emitClassInfoEntry(M, infoElems, infoEntries);
                             }
                         }
 
-                        // No entries in this file, no need to call initializer
-                        if (infoElems.size() == 0) {
-                            return false;
+                        // No entries in this file, no need to register the section
+                        if (!infoEntries.empty()) {
+                            TypeSanUtil::appendToUsed(M, infoEntries);
+                            TypeSanUtil::createSectionTableCtor(M, "typesan_cinfo", "__register_cinfo_table", false,
+                                    "__unregister_cinfo_table");
+                        }
+                        if (!nameEntries.empty()) {
+                            TypeSanUtil::appendToUsed(M, nameEntries);
+                            TypeSanUtil::createSectionTableCtor(M, "typesan_names", "__typesan_register_names", false,
+                                    "__typesan_unregister_names");
                         }
-
-                        ArrayType *InfoArrayType = ArrayType::get(Int64Ty, infoElems.size());
-                        Constant* infoArray = ConstantArray::get(InfoArrayType, infoElems);
-                        GlobalVariable* infoGlobal = new GlobalVariable(M, InfoArrayType, false, 
-                                                GlobalVariable::LinkageTypes::InternalLinkage,
-                                                nullptr, mname + ".cinfo");
-                        infoGlobal->setInitializer(infoArray);
-                        
-			///////////////////////////////////////////////
-			// Update meta-data using global constuctor
-			///////////////////////////////////////////////
-
-
-			FTy = FunctionType::get(Type::getVoidTy(Ctx), false);  
-			Function *F = Function::Create(FTy, GlobalValue::InternalLinkage,  
-					"__init", SrcM);
-
-			F->setUnnamedAddr(true);                                           
-			F->setLinkage(GlobalValue::InternalLinkage);
-			F->addFnAttr(Attribute::NoInline);
-
-			BasicBlock *BB = BasicBlock::Create(Ctx, "entry", F);             
-			IRBuilder<> Builder(BB);
-
-                        string initName = "__update_cinfo";
-                        
-			Constant *GCOVInit = SrcM->getOrInsertFunction(initName, VoidTy, Int64Ty, Int64PtrTy, nullptr);
-			Builder.CreateCall(GCOVInit, {ConstantInt::get(Int64Ty, classCount), Builder.CreatePointerCast(infoGlobal, Int64PtrTy)});
-			Builder.CreateRetVoid(); 
-
-			appendToGlobalCtors(M, F, 0); 
 			
 			return false;
 		}
 
+		void emitClassInfoEntry(Module &M, const std::vector<uint64_t> &infoElems, std::vector<GlobalValue *> &infoEntries) {
+			// FNV-1a over the entry identifies identical entries across modules
+			uint64_t contentHash = 14695981039346656037ULL;
+			for (uint64_t elem : infoElems) {
+				contentHash = (contentHash ^ elem) * 1099511628211ULL;
+			}
+			string entryName = "__typesan_cinfo." + utohexstr(infoElems[1]) + "." + utohexstr(contentHash);
+			if (M.getGlobalVariable(entryName, true)) {
+				return;
+			}
+			std::vector<Constant*> entryElems;
+			for (uint64_t elem : infoElems) {
+				entryElems.push_back(ConstantInt::get(Int64Ty, elem));
+			}
+			ArrayType *EntryType = ArrayType::get(Int64Ty, entryElems.size());
+			GlobalVariable *entry = new GlobalVariable(M, EntryType, true,
+					GlobalValue::LinkOnceODRLinkage, ConstantArray::get(EntryType, entryElems), entryName);
+			entry->setVisibility(GlobalValue::HiddenVisibility);
+			entry->setComdat(M.getOrInsertComdat(entryName));
+			entry->setSection("typesan_cinfo");
+			entry->setAlignment(8);
+			infoEntries.push_back(entry);
+		}
+
+		// Name of each class hash for the reports, as a COMDAT record of
+		// {hash, NUL-terminated name} in the typesan_names section. Only the
+		// runtime's report writer reads the section, so its pages are not
+		// touched unless a report is written.
+		void emitTypeNameEntry(Module &M, uint64_t classHash, const string &name, std::vector<GlobalValue *> &nameEntries) {
+			string entryName = "__typesan_name." + utohexstr(classHash);
+			if (M.getGlobalVariable(entryName, true)) {
+				return;
+			}
+			Constant *entryElems[] = {
+				ConstantInt::get(Int64Ty, classHash),
+				ConstantDataArray::getString(M.getContext(), name)
+			};
+			Constant *entryInit = ConstantStruct::getAnon(entryElems);
+			GlobalVariable *entry = new GlobalVariable(M, entryInit->getType(), true,
+					GlobalValue::LinkOnceODRLinkage, entryInit, entryName);
+			entry->setVisibility(GlobalValue::HiddenVisibility);
+			entry->setComdat(M.getOrInsertComdat(entryName));
+			entry->setSection("typesan_names");
+			entry->setAlignment(8);
+			nameEntries.push_back(entry);
+		}
+
 		virtual bool runOnFunction(Function &F) {
 			
 			return false;
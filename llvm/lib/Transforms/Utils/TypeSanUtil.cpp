@@ -20,6 +20,11 @@
 #include "llvm/IR/Constants.h"
 #include "llvm/Analysis/ConstantFolding.h"
 #include "llvm/Analysis/MemoryBuiltins.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Utils/TypeSanUtil.h"
 
 #include <iostream>
@@ -32,12 +37,64 @@
 using namespace llvm;
 using std::string;
 
-#define PAGESHIFT 12
 //#define TRACK_ALLOCATIONS
 
+// Shared by TypeSanPass (metadata granularity) and MetaStack (frame layout),
+// the runtime picks it up through __metastack_align_bits
+static cl::opt<unsigned> ClStackAlignBits("typesan-stack-align-bits",
+    cl::desc("log2 of the tracked stack object alignment and metadata granularity"),
+    cl::Hidden, cl::init(4));
+
+static cl::opt<bool> ClProfileAllocs("typesan-profile-allocs",
+    cl::desc("Count tracked allocations per site at run time, for typesan_blacklist.py"),
+    cl::Hidden, cl::init(false));
+
 namespace llvm {
         
     TypeSanLoggerClass TypeSanLogger;
+
+    TypeSanLoggerClass::TypeSanLoggerClass() {
+        enabled = getenv("TYPECHECK_LOGFILE") != nullptr;
+    }
+
+    // The shard gets a unique name and is renamed into place once complete,
+    // so parallel compiler runs never wait for each other and the merge
+    // never reads a partial shard.
+    TypeSanLoggerClass::~TypeSanLoggerClass() {
+        if (!enabled) {
+            return;
+        }
+        string shardDir = string(getenv("TYPECHECK_LOGFILE")) + ".shards";
+        SmallString<128> tmpPath;
+        int fd;
+        if (sys::fs::create_directories(shardDir) ||
+            sys::fs::createUniqueFile(shardDir + "/%%%%%%%%%%%%%%%%.tmp", fd, tmpPath)) {
+            return;
+        }
+        {
+            raw_fd_ostream outputFile(fd, true);
+            outputFile << staticDownCasts << "\n";
+            outputFile << trackedStack << "\n";
+            outputFile << trackedGlobal << "\n";
+            outputFile << trackedHeap << "\n";
+            for (auto &hashMappingEntry : hashMapping) {
+                outputFile << hashMappingEntry.first << "\n";
+                outputFile << hashMappingEntry.second << "\n";
+            }
+            // The stream would otherwise turn a failed write into a fatal
+            // error while the compiler exits; drop the partial shard instead
+            outputFile.close();
+            if (outputFile.has_error()) {
+                errs() << "warning: TypeSan: failed to write log shard " << tmpPath << "\n";
+                outputFile.clear_error();
+                sys::fs::remove(tmpPath);
+                return;
+            }
+        }
+        SmallString<128> shardPath(tmpPath);
+        sys::path::replace_extension(shardPath, "shard");
+        sys::fs::rename(tmpPath, shardPath);
+    }
     
 		static unsigned int crc32c(unsigned char *message) {
 			int i, j;
@@ -311,18 +368,117 @@ namespace llvm {
             return nullptr;
         }
                 
-        uint64_t TypeSanUtil::getHashCodeFromStruct(StructType *type) {
+        string TypeSanUtil::getHashNameFromStruct(StructType *type) {
             string str;
             if (!type->isLiteral())
                 str = type->getName();
             else
                 str = "trackedtype._";
             remove_useless_str(str);
+            return str;
+        }
+
+        uint64_t TypeSanUtil::getHashCodeFromStruct(StructType *type) {
+            string str = getHashNameFromStruct(type);
             uint64_t hash = GetHashValue(str);
             TypeSanLogger.addHash(hash, str);
             return hash;
         }
+
+        unsigned TypeSanUtil::getStackAlignBits() {
+            // Below 8 bytes a vtable pointer spans granules, above a page
+            // the page-table alignment field no longer describes the layout
+            if (ClStackAlignBits < 3 || ClStackAlignBits > METALLOC_PAGESHIFT)
+                report_fatal_error("-typesan-stack-align-bits must be between 3 and 12");
+            return ClStackAlignBits;
+        }
         
+        void TypeSanUtil::appendToUsed(Module &M, ArrayRef<GlobalValue *> values) {
+            Type *Int8PtrTy = Type::getInt8PtrTy(M.getContext());
+            SmallPtrSet<GlobalValue *, 8> usedSet;
+            GlobalVariable *used = collectUsedGlobalVariables(M, usedSet, false);
+            std::vector<Constant *> usedList;
+            if (used) {
+                for (Use &U : cast<ConstantArray>(used->getInitializer())->operands()) {
+                    usedList.push_back(cast<Constant>(U.get()));
+                }
+                used->eraseFromParent();
+            }
+            for (GlobalValue *GV : values) {
+                usedList.push_back(ConstantExpr::getPointerBitCastOrAddrSpaceCast(GV, Int8PtrTy));
+            }
+            ArrayType *usedTy = ArrayType::get(Int8PtrTy, usedList.size());
+            used = new GlobalVariable(M, usedTy, false, GlobalValue::AppendingLinkage,
+                    ConstantArray::get(usedTy, usedList), "llvm.used");
+            used->setSection("llvm.metadata");
+        }
+
+        // ELF header of the object this module ends up in, so the runtime can
+        // find its segments without walking every loaded object. The linker
+        // defines __ehdr_start; it is weak so that links without it pass null.
+        Constant *TypeSanUtil::getObjectHeader(Module &M) {
+            GlobalVariable *ehdr = M.getGlobalVariable("__ehdr_start");
+            if (!ehdr) {
+                ehdr = new GlobalVariable(M, Type::getInt8Ty(M.getContext()), true,
+                        GlobalValue::ExternalWeakLinkage, nullptr, "__ehdr_start");
+                ehdr->setVisibility(GlobalValue::HiddenVisibility);
+            }
+            return ehdr;
+        }
+
+        // Comdat function named fnName that calls calleeName with the bounds of
+        // section, and the DSO's ELF header with passObjectHeader
+        static Function *createSectionTableFunction(Module &M, StringRef section, const string &fnName, StringRef calleeName, bool passObjectHeader) {
+            LLVMContext &Ctx = M.getContext();
+            Type *Int8Ty = Type::getInt8Ty(Ctx);
+            Type *Int8PtrTy = Type::getInt8PtrTy(Ctx);
+            FunctionType *VoidFTy = FunctionType::get(Type::getVoidTy(Ctx), false);
+            Function *F = Function::Create(VoidFTy, GlobalValue::LinkOnceODRLinkage, fnName, &M);
+            F->setVisibility(GlobalValue::HiddenVisibility);
+            F->setComdat(M.getOrInsertComdat(fnName));
+            IRBuilder<> Builder(BasicBlock::Create(Ctx, "entry", F));
+            std::vector<Value *> args;
+            string boundNames[2] = { "__start_" + section.str(), "__stop_" + section.str() };
+            for (int i = 0; i < 2; ++i) {
+                GlobalVariable *bound = M.getGlobalVariable(boundNames[i]);
+                if (!bound) {
+                    bound = new GlobalVariable(M, Int8Ty, false,
+                            GlobalValue::ExternalLinkage, nullptr, boundNames[i]);
+                    bound->setVisibility(GlobalValue::HiddenVisibility);
+                }
+                args.push_back(bound);
+            }
+            if (passObjectHeader) {
+                args.push_back(TypeSanUtil::getObjectHeader(M));
+            }
+            std::vector<Type *> argTypes(args.size(), Int8PtrTy);
+            Function *callee = (Function*)M.getOrInsertFunction(calleeName,
+                    FunctionType::get(Type::getVoidTy(Ctx), argTypes, false));
+            Builder.CreateCall(callee, args);
+            Builder.CreateRetVoid();
+            return F;
+        }
+
+        // One constructor per DSO hands a whole table section to the runtime:
+        // it lives in a comdat, and the linker-defined section bounds are
+        // hidden so that each DSO sees its own table. With passObjectHeader
+        // the DSO's ELF header is passed along as a third argument. With an
+        // unregisterName, a matching destructor hands the bounds back before
+        // the DSO is unloaded.
+        void TypeSanUtil::createSectionTableCtor(Module &M, StringRef section, StringRef registerName, bool passObjectHeader, StringRef unregisterName) {
+            string ctorName = "__typesan_register_" + section.str();
+            if (M.getFunction(ctorName)) {
+                return;
+            }
+            Function *ctor = createSectionTableFunction(M, section, ctorName, registerName, passObjectHeader);
+            appendToGlobalCtors(M, ctor, 0, ctor);
+            if (!unregisterName.empty()) {
+                Function *dtor = createSectionTableFunction(M, section,
+                        "__typesan_unregister_" + section.str(), unregisterName, passObjectHeader);
+                appendToGlobalDtors(M, dtor, 0, dtor);
+            }
+        }
+
         static GlobalVariable *getOrPopulateTypeInfo(Module *SrcM, Type *Int64Ty, StructNode *structNode, string &name) {
             if (structNode->baseType->isLiteral()) {
                 name = "trackedtype._";
@@ -376,6 +532,32 @@ namespace llvm {
             return typeInfo;
         }
         
+	Constant *TypeSanUtil::getAllocationTypeInfo(Module *SrcM, Type *allocationType, unsigned long count) {
+                TypeNode *typeNode = getStructLayout(DL, allocationType, nullptr);
+                StructNode *structNode = nullptr;
+                if (count != 0) {
+                    ArrayNode *tmpArrayNode = ArrayNode::create(count, typeNode);
+                    structNode = tmpArrayNode->element;
+                    count = tmpArrayNode->count;
+                } else {
+                    structNode = typeNode->asStructNode();
+                    if (structNode == nullptr) {
+                        structNode = typeNode->asArrayNode()->element;
+                    }
+                }
+                // No support for anonymous structs yet
+                if (structNode->baseType->isLiteral()) {
+                    return nullptr;
+                }
+		string typeName;
+                GlobalVariable *typeInfo = getOrPopulateTypeInfo(SrcM, Int64Ty, structNode, typeName);
+                // Single objects skip the leading size field, as in insertUpdateMetalloc
+                if (count == 1) {
+                    return ConstantExpr::getAdd(ConstantExpr::getPtrToInt(typeInfo, Int64Ty), ConstantInt::get(Int64Ty, 8));
+                }
+                return ConstantExpr::getPtrToInt(typeInfo, Int64Ty);
+	}
+
 	bool TypeSanUtil::interestingType(Type *rootType) {
 
 		StructType *STy = dyn_cast<StructType>(rootType);
@@ -415,17 +597,33 @@ namespace llvm {
                     ptrToStore = ptrToInt;
                 }
                 
-		Value *pageIdx = Builder.CreateLShr(ptrToInt, ConstantInt::get(Int64Ty, PAGESHIFT));
+		Value *pageIdx = Builder.CreateLShr(ptrToInt, ConstantInt::get(Int64Ty, METALLOC_PAGESHIFT));
 		Value *pageTableBase = Builder.CreateIntToPtr(MetaPageTable, Int64PtrTy);
 		Value *pageTablePtr = Builder.CreateGEP(pageTableBase, pageIdx);
 		Value *pageTableEntry = Builder.CreateLoad(pageTablePtr);
-		Value *metadataBaseInt = Builder.CreateLShr(pageTableEntry, ConstantInt::get(Int64Ty, 8));
-		Value *alignmentValue = (alignment != 0) ? ConstantInt::get(Int64Ty, alignment) : Builder.CreateAnd(pageTableEntry, ConstantInt::get(Int64Ty, 0xFF));
+		Value *metadataBaseInt = Builder.CreateLShr(pageTableEntry, ConstantInt::get(Int64Ty, METALLOC_ENTRYBASESHIFT));
+		Value *alignmentValue = (alignment != 0) ? ConstantInt::get(Int64Ty, alignment) : Builder.CreateAnd(pageTableEntry, ConstantInt::get(Int64Ty, 0x3F));
 		Value *alignmentOffset = (alignment != 0) ? ConstantInt::get(Int64Ty, (1 << alignment) - 1) : Builder.CreateSub(Builder.CreateShl(
 			ConstantInt::get(Int64Ty, 1), alignmentValue), ConstantInt::get(Int64Ty, 1));
+		Value *pageOffset = Builder.CreateAnd(ptrToInt, ConstantInt::get(Int64Ty, (1 << METALLOC_PAGESHIFT) - 1));
+		Value *metadataIndex = Builder.CreateLShr(pageOffset, alignmentValue);
+		// Heap pages of non-power-of-two size classes use object entries (see metapagetable_core.h),
+		// which index one metadata entry per object through the reciprocal of the object size
+		Value *isObjectEntry = nullptr;
+		if (alignment == 0) {
+			isObjectEntry = Builder.CreateICmpNE(Builder.CreateAnd(pageTableEntry, ConstantInt::get(Int64Ty, METALLOC_OBJECTFLAG)), ConstantInt::get(Int64Ty, 0));
+			Value *objectBaseInt = Builder.CreateShl(Builder.CreateLShr(pageTableEntry, ConstantInt::get(Int64Ty, METALLOC_OBJECTMETASHIFT)), 3);
+			Value *objectPhase = Builder.CreateAnd(metadataBaseInt, ConstantInt::get(Int64Ty, (1 << METALLOC_PAGESHIFT) - 1));
+			Value *objectClass = Builder.CreateAnd(pageTableEntry, ConstantInt::get(Int64Ty, METALLOC_OBJECTCLASSES - 1));
+			Constant *Reciprocals = SrcM->getOrInsertGlobal("metalloc_object_reciprocals", ArrayType::get(Int32Ty, METALLOC_OBJECTCLASSES));
+			Value *reciprocalPtr = Builder.CreateGEP(Reciprocals, {ConstantInt::get(Int64Ty, 0), objectClass});
+			Value *reciprocal = Builder.CreateZExt(Builder.CreateLoad(reciprocalPtr), Int64Ty);
+			Value *objectIndex = Builder.CreateLShr(Builder.CreateMul(Builder.CreateAdd(pageOffset, objectPhase), reciprocal), 32);
+			metadataBaseInt = Builder.CreateSelect(isObjectEntry, objectBaseInt, metadataBaseInt);
+			metadataIndex = Builder.CreateSelect(isObjectEntry, objectIndex, metadataIndex);
+		}
 		Value *metadataBase = Builder.CreateIntToPtr(metadataBaseInt, Int64PtrTy);
-		Value *pageOffset = Builder.CreateAnd(ptrToInt, ConstantInt::get(Int64Ty, (1 << PAGESHIFT) - 1));
-		Value *metadataOffset = Builder.CreateShl(Builder.CreateLShr(pageOffset, alignmentValue), 1);
+		Value *metadataOffset = Builder.CreateShl(metadataIndex, 1);
 		Value *metadataPtr = Builder.CreateGEP(metadataBase, metadataOffset);
 		// Inline stores if size and alignment are known constants (stack/globals)
 		bool didInline = false;
@@ -469,6 +667,9 @@ namespace llvm {
                                     typeInfoPtrInt = ConstantExpr::getPtrToInt(typeInfo, Int64Ty);
                                 }
 			}
+			if (isObjectEntry) {
+				metadataSize = Builder.CreateSelect(isObjectEntry, ConstantInt::get(Int64Ty, 1), metadataSize);
+			}
 			Function *MetallocMemset = (Function*)SrcM->getOrInsertFunction("metalloc_widememset", VoidTy, Int64PtrTy, Int64Ty, Int64Ty, Int64Ty, nullptr);
 			Value *Param[4] = {metadataPtr, metadataSize, ptrToStore, typeInfoPtrInt};
 			Builder.CreateCall(MetallocMemset, Param);
@@ -492,5 +693,53 @@ namespace llvm {
 #endif
 	}
 
+
+	// With -typesan-profile-allocs, every tracked allocation of a C++ type
+	// reports its site record, base and size to the runtime, which weighs
+	// metadata writes against the casts made on the objects
+	void TypeSanUtil::insertAllocProfile(Module *SrcM, IRBuilder<> &Builder, Value *ptrValue, Type *allocationType, Value *size, string allocName) {
+		if (!ClProfileAllocs) {
+			return;
+		}
+		TypeNode *typeNode = getStructLayout(DL, allocationType, nullptr);
+		if (typeNode == nullptr) {
+			return;
+		}
+		StructNode *structNode = typeNode->asStructNode();
+		if (structNode == nullptr) {
+			structNode = typeNode->asArrayNode()->element;
+		}
+		StructType *STy = structNode->baseType;
+		if (STy->isLiteral() || !STy->getName().startswith("trackedtype.")) {
+			return;
+		}
+		// Struct names are the mangled RTTI name after the prefix, up to any
+		// suffix LLVM added to keep them unique
+		StringRef typeName = STy->getName().substr(strlen("trackedtype."));
+		typeName = typeName.substr(0, typeName.find('.'));
+		Function *F = Builder.GetInsertBlock()->getParent();
+
+		LLVMContext &Ctx = SrcM->getContext();
+		Constant *siteData[] = {
+			ConstantInt::get(Int32Ty, 0),
+			ConstantInt::get(Int32Ty, 0),
+			ConstantInt::get(Int64Ty, getHashCodeFromStruct(STy)),
+			cast<Constant>(Builder.CreateGlobalStringPtr(typeName)),
+			cast<Constant>(Builder.CreateGlobalStringPtr(F->getName())),
+			cast<Constant>(Builder.CreateGlobalStringPtr(allocName)),
+		};
+		Constant *siteInit = ConstantStruct::getAnon(Ctx, siteData);
+		GlobalVariable *site = new GlobalVariable(*SrcM, siteInit->getType(), false,
+				GlobalValue::PrivateLinkage, siteInit, "__typesan_alloc_site");
+		site->setAlignment(8);
+		Function *ProfileAlloc = (Function*)SrcM->getOrInsertFunction("__typesan_profile_alloc", Type::getVoidTy(Ctx),
+				Int8PtrTy, Int64Ty, Int64Ty, nullptr);
+		Value *Param[3] = {
+			Builder.CreatePointerCast(site, Int8PtrTy),
+			Builder.CreatePtrToInt(ptrValue, Int64Ty),
+			Builder.CreateZExtOrTrunc(size, Int64Ty),
+		};
+		Builder.CreateCall(ProfileAlloc, Param);
+	}
 }
 
@@ -0,0 +1,43 @@
+//===-- sanitizer/metastack_interface.h -------------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file is a part of TypeSan.
+//
+// Public interface header for the tracked stacks of stack-allocated objects.
+//===----------------------------------------------------------------------===//
+#ifndef SANITIZER_METASTACK_INTERFACE_H
+#define SANITIZER_METASTACK_INTERFACE_H
+
+#include <stddef.h>
+#include <ucontext.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+  // Contexts set up with makecontext() get a tracked stack of the size of
+  // their native stack, switched by swapcontext() and setcontext(). Calling
+  // makecontext() again on the same ucontext_t reuses that tracked stack.
+  // Otherwise it lives until the context is released below, so call this
+  // before a ucontext_t made by makecontext() is freed or goes out of scope;
+  // contexts that are never released leak their tracked stack.
+  void __metastack_context_release(ucontext_t *ucp);
+
+  // Code that switches native stacks by hand creates a tracked stack per
+  // fiber and calls __metastack_fiber_switch() next to each native stack
+  // switch. Switching to NULL returns to the thread's own tracked stack.
+  void *__metastack_fiber_create(size_t size);
+  void __metastack_fiber_destroy(void *fiber);
+  void __metastack_fiber_switch(void *fiber);
+  void *__metastack_fiber_current(void);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // SANITIZER_METASTACK_INTERFACE_H
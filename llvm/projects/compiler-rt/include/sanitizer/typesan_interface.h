@@ -0,0 +1,53 @@
+//===-- sanitizer/typesan_interface.h ---------------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file is a part of TypeSan.
+//
+// Public interface header.
+//===----------------------------------------------------------------------===//
+#ifndef SANITIZER_TYPESAN_INTERFACE_H
+#define SANITIZER_TYPESAN_INTERFACE_H
+
+#include <sanitizer/common_interface_defs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+  // Objects created by placement new of a class type are registered by the
+  // compiler. Custom allocators only need the calls below to manage the
+  // memory those objects live in.
+
+  // Give the whole pages of [p, p + size) their own fine-grained metadata,
+  // so that every object placed in them can be described. Use this for
+  // arenas and pools carved from mmap'd memory or from a single large heap
+  // allocation. Must be undone with __typesan_unregister_range() before the
+  // memory is returned to its underlying allocator.
+  void __typesan_register_range(const void *p, size_t size);
+
+  // Forget the objects in [p, p + size), e.g. when an arena is reset. If
+  // [p, p + size) was registered with __typesan_register_range(), its
+  // metadata is released and the previous metadata restored.
+  void __typesan_unregister_range(const void *p, size_t size);
+
+  // Describe count objects at p with the type information TypeSan emitted
+  // for their type. This is what placement new compiles to; objects whose
+  // memory cannot be described precisely are skipped, and casts on them are
+  // not checked.
+  void __typesan_register_object(const void *p, unsigned long typeinfo,
+                                 size_t count);
+
+  // With TYPESAN_OPTIONS=profile_path=<path>, write the per-cast-site
+  // profile gathered so far to <path>.<pid>. This also happens at exit.
+  void __typesan_dump_profile(void);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // SANITIZER_TYPESAN_INTERFACE_H
@@ -1,10 +1,17 @@
 #include <sys/mman.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <dlfcn.h>
 #include <link.h>
+#include <unistd.h>
 #include <metapagetable_core.h>
 
+#include "interception/interception.h"
+#include "sanitizer_common/sanitizer_allocator_internal.h"
 #include "sanitizer_common/sanitizer_common.h"
+#include "sanitizer_common/sanitizer_mutex.h"
+
+using namespace __sanitizer;
 
 extern char __executable_start;
 extern char _etext;
@@ -16,39 +23,381 @@ extern char _end;
 const int kMetaPageSize = 4096;
 const unsigned kMetaGlobalAlignBits = 3;
 
-static int shared_object_callback(struct dl_phdr_info *info, size_t size, void *data) {
-    for (int i = 0; i < info->dlpi_phnum; i++) {
-        if (info->dlpi_phdr[i].p_type != PT_LOAD) {
-            continue;
+/// Page-aligned range of a PT_LOAD segment that has global metadata.
+struct metaglobal_segment {
+    unsigned long start;
+    unsigned long size;
+};
+
+/// Every object whose globals are tracked, keyed by its load bias. Objects
+/// are registered once, from their own constructors, and only their
+/// writable segments get metadata up front; read-only segments are added
+/// when a tracked global turns out to live there.
+struct metaglobal_object {
+    const ElfW(Ehdr) *ehdr;
+    unsigned long bias;
+    metaglobal_segment *segments;
+    unsigned long segment_count;
+    metaglobal_object *next;
+};
+
+const unsigned kMetaGlobalObjectBuckets = 1024;
+static StaticSpinMutex metaglobal_objects_lock;
+static metaglobal_object *metaglobal_objects[kMetaGlobalObjectBuckets];
+
+static metaglobal_object **metaglobal_object_find(unsigned long bias) {
+    metaglobal_object **link =
+        &metaglobal_objects[(bias >> METALLOC_PAGESHIFT) % kMetaGlobalObjectBuckets];
+    while (*link && (*link)->bias != bias)
+        link = &(*link)->next;
+    return link;
+}
+
+static const ElfW(Phdr) *object_phdrs(const ElfW(Ehdr) *ehdr) {
+    return (const ElfW(Phdr) *)((const char *)ehdr + ehdr->e_phoff);
+}
+
+static unsigned long object_bias(const ElfW(Ehdr) *ehdr) {
+    const ElfW(Phdr) *phdr = object_phdrs(ehdr);
+    for (int i = 0; i < ehdr->e_phnum; i++) {
+        if (phdr[i].p_type == PT_LOAD && phdr[i].p_offset == 0) {
+            return (unsigned long)ehdr - phdr[i].p_vaddr;
+        }
+    }
+    return (unsigned long)ehdr;
+}
+
+/// ELF header of the object containing addr, for objects built without a
+/// reference to __ehdr_start.
+static const ElfW(Ehdr) *object_header(unsigned long addr) {
+    Dl_info info;
+    if (dladdr((void *)addr, &info) == 0) {
+        return nullptr;
+    }
+    return (const ElfW(Ehdr) *)info.dli_fbase;
+}
+
+static void register_segment(metaglobal_object *object, const ElfW(Phdr) *phdr) {
+    unsigned long base_addr = object->bias + phdr->p_vaddr;
+    unsigned long section_size = phdr->p_memsz;
+    if (section_size == 0) {
+        return;
+    }
+    unsigned long page_align_offset = kMetaPageSize - 1;
+    unsigned long page_align_mask = ~((unsigned long)kMetaPageSize - 1);
+    unsigned long aligned_start = base_addr & page_align_mask;
+    unsigned long aligned_size = ((section_size + base_addr - aligned_start) + page_align_offset) & page_align_mask;
+    // Pages already described, e.g. shared with a neighbouring segment, keep their metadata
+    if (pageTable[aligned_start >> METALLOC_PAGESHIFT] != 0) {
+        return;
+    }
+    void *exec_metadata = allocate_category_metadata(aligned_size, kMetaGlobalAlignBits, METALLOC_USAGE_GLOBALS);
+    set_metapagetable_entries((void*)aligned_start, aligned_size, exec_metadata, kMetaGlobalAlignBits);
+    METALLOC_PROBE2(globals__segment, aligned_start, aligned_size);
+    metaglobal_segment *segment = &object->segments[object->segment_count++];
+    segment->start = aligned_start;
+    segment->size = aligned_size;
+}
+
+static metaglobal_object *register_object(const ElfW(Ehdr) *ehdr) {
+    if (ehdr == nullptr) {
+        return nullptr;
+    }
+    unsigned long bias = object_bias(ehdr);
+    SpinMutexLock lock(&metaglobal_objects_lock);
+    metaglobal_object **link = metaglobal_object_find(bias);
+    if (*link) {
+        return *link;
+    }
+    const ElfW(Phdr) *phdr = object_phdrs(ehdr);
+    unsigned long load_count = 0;
+    for (int i = 0; i < ehdr->e_phnum; i++) {
+        if (phdr[i].p_type == PT_LOAD) {
+            load_count++;
+        }
+    }
+    metaglobal_object *object = (metaglobal_object *)InternalAlloc(sizeof(metaglobal_object));
+    object->ehdr = ehdr;
+    object->bias = bias;
+    object->segments = (metaglobal_segment *)InternalAlloc((load_count ? load_count : 1) * sizeof(metaglobal_segment));
+    object->segment_count = 0;
+    object->next = nullptr;
+    for (int i = 0; i < ehdr->e_phnum; i++) {
+        if (phdr[i].p_type == PT_LOAD && (phdr[i].p_flags & PF_W)) {
+            register_segment(object, &phdr[i]);
         }
-        unsigned long base_addr = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
-        unsigned long section_size = info->dlpi_phdr[i].p_memsz;
-        if (section_size == 0) {
-            continue;
+    }
+    *link = object;
+    METALLOC_PROBE2(globals__object, ehdr, object->segment_count);
+    return object;
+}
+
+/// Give the segment of object holding addr metadata, for tracked globals
+/// placed in read-only data.
+static void register_segment_at(metaglobal_object *object, unsigned long addr) {
+    if (object == nullptr) {
+        return;
+    }
+    SpinMutexLock lock(&metaglobal_objects_lock);
+    if (pageTable[addr >> METALLOC_PAGESHIFT] != 0) {
+        return;
+    }
+    const ElfW(Phdr) *phdr = object_phdrs(object->ehdr);
+    for (int i = 0; i < object->ehdr->e_phnum; i++) {
+        unsigned long start = object->bias + phdr[i].p_vaddr;
+        if (phdr[i].p_type == PT_LOAD && addr >= start && addr < start + phdr[i].p_memsz) {
+            register_segment(object, &phdr[i]);
+            return;
         }
-        if (pageTable[(info->dlpi_addr + info->dlpi_phdr[i].p_vaddr) >> METALLOC_PAGESHIFT] != 0) {
-            return 0;
+    }
+}
+
+/// Per-thread initializer TypeSanPass emits for the tracked thread-local
+/// globals of one module, registered from the module's constructor.
+struct metaglobal_thread_init {
+    void (*init)();
+    unsigned long bias;
+    metaglobal_thread_init *next;
+};
+
+static metaglobal_thread_init *metaglobal_thread_inits;
+
+/// Static TLS block of the current thread, once it has metadata. Threads
+/// whose block cannot be given metadata are marked as skipped so that the
+/// check is not repeated.
+static __thread unsigned long thread_tls_start;
+static __thread unsigned long thread_tls_size;
+static __thread bool thread_tls_skipped;
+
+/// Give the static TLS block of the current thread metadata. Thread-local
+/// globals of objects loaded later with dlopen may live in dynamically
+/// allocated TLS instead and stay untracked.
+static void register_thread_tls() {
+    if (thread_tls_size != 0 || thread_tls_skipped) {
+        return;
+    }
+    thread_tls_skipped = true;
+    uptr stk_addr, stk_size, tls_addr, tls_size;
+    GetThreadStackAndTls((uptr)getpid() == GetTid(), &stk_addr, &stk_size, &tls_addr, &tls_size);
+    if (tls_size == 0) {
+        return;
+    }
+    unsigned long start = RoundDownTo(tls_addr, kMetaPageSize);
+    unsigned long size = RoundUpTo(tls_addr + tls_size, kMetaPageSize) - start;
+    // Leave pages that are already described alone; their metadata may be
+    // live, so the thread's thread-local globals go untracked instead
+    for (unsigned long page = start; page < start + size; page += kMetaPageSize) {
+        if (pageTable[page >> METALLOC_PAGESHIFT] != 0) {
+            VReport(1, "metaglobal: static TLS of thread %d at %p shares page %p "
+                "with other metadata, its thread-local globals are not tracked\n",
+                (int)GetTid(), (void*)tls_addr, (void*)page);
+            return;
         }
-        unsigned long page_align_offset = kMetaPageSize - 1;
-        unsigned long page_align_mask = ~((unsigned long)kMetaPageSize - 1);
-        unsigned long aligned_start = base_addr & page_align_mask;
-        unsigned long aligned_size = ((section_size + base_addr - aligned_start) + page_align_offset) & page_align_mask;
-        void *exec_metadata = allocate_metadata(aligned_size, kMetaGlobalAlignBits);
-        set_metapagetable_entries((void*)aligned_start, aligned_size, exec_metadata, kMetaGlobalAlignBits);
     }
-    return 0;
+    void *metadata = allocate_category_metadata(size, kMetaGlobalAlignBits, METALLOC_USAGE_GLOBALS);
+    set_metapagetable_entries((void*)start, size, metadata, kMetaGlobalAlignBits);
+    thread_tls_start = start;
+    thread_tls_size = size;
+    thread_tls_skipped = false;
 }
 
+static void set_global_metadata(unsigned long addr, unsigned long size, unsigned long typeinfo) {
+    unsigned long entry = pageTable[addr >> METALLOC_PAGESHIFT];
+    if (entry == 0) {
+        return;
+    }
+    unsigned long *metadata = (unsigned long *)metapagetable_entry_base(entry) +
+        2 * metapagetable_entry_index(entry, addr);
+    unsigned long count = metapagetable_entry_count(entry, size);
+    for (unsigned long i = 0; i < count; ++i) {
+        metadata[2 * i] = addr;
+        metadata[2 * i + 1] = typeinfo;
+    }
+}
+
+static void release_object(metaglobal_object *object) {
+    for (unsigned long i = 0; i < object->segment_count; ++i) {
+        metaglobal_segment *segment = &object->segments[i];
+        deallocate_category_metadata((void*)segment->start, segment->size, kMetaGlobalAlignBits, METALLOC_USAGE_GLOBALS);
+        set_metapagetable_entries((void*)segment->start, segment->size, 0, 0);
+    }
+    InternalFree(object->segments);
+    InternalFree(object);
+}
+
+/// Register the object containing the given address. Kept for objects
+/// instrumented before the per-object constructors took an ELF header.
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
-void metalloc_init_globals(unsigned int object) {
+void metalloc_init_globals(unsigned long object) {
+    METALLOC_PROBE1(globals__init, object);
     // Check if this shared object has already been loaded or not
     // Enough to check single object for mapping
     if (pageTable[object >> METALLOC_PAGESHIFT] != 0) {
         return;
     }
-    dl_iterate_phdr(&shared_object_callback, NULL);
+    register_segment_at(register_object(object_header(object)), object);
+}
+
+/// Register the object starting at ehdr, called once per object from its
+/// constructor with the linker-provided __ehdr_start.
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void metalloc_register_object(const void *ehdr) {
+    register_object((const ElfW(Ehdr) *)ehdr);
+}
+
+/// Make sure the tracked global at addr, defined by the object starting at
+/// ehdr, has metadata even if it lives in a read-only segment.
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void metalloc_register_global_segment(const void *ehdr, unsigned long addr) {
+    if (pageTable[addr >> METALLOC_PAGESHIFT] != 0) {
+        return;
+    }
+    register_segment_at(register_object((const ElfW(Ehdr) *)ehdr), addr);
+}
+
+/// Record TypeSanPass emits into the typesan_globals section for each tracked
+/// global with a typeinfo.
+struct metaglobal_record {
+    unsigned long addr;
+    unsigned long size;
+    unsigned long typeinfo;
+};
+
+/// Apply the typesan_globals section of one DSO, called once per DSO from a
+/// comdat constructor. ehdr is the DSO's __ehdr_start, or null if the linker
+/// did not provide one.
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void metalloc_register_globals(const metaglobal_record *start, const metaglobal_record *stop,
+        const void *ehdr) {
+    if (start == stop) {
+        return;
+    }
+    metaglobal_object *object = register_object(ehdr ?
+            (const ElfW(Ehdr) *)ehdr : object_header(start->addr));
+    for (const metaglobal_record *record = start; record < stop; ++record) {
+        unsigned long entry = pageTable[record->addr >> METALLOC_PAGESHIFT];
+        if (entry == 0) {
+            register_segment_at(object, record->addr);
+            entry = pageTable[record->addr >> METALLOC_PAGESHIFT];
+        }
+        // Globals outside of this object's segments are not tracked
+        set_global_metadata(record->addr, record->size, record->typeinfo);
+    }
+}
+
+/// Describe the current thread's copy of a tracked thread-local global,
+/// called from the per-thread initializers TypeSanPass emits.
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void metalloc_thread_global(void *addr, unsigned long size, unsigned long typeinfo) {
+    // Copies outside of the static TLS block are not tracked
+    unsigned long object = (unsigned long)addr;
+    if (object < thread_tls_start || object + size > thread_tls_start + thread_tls_size) {
+        return;
+    }
+    set_global_metadata(object, size, typeinfo);
+}
 
-    return;
+/// Run init, which describes the thread-local globals of the object starting
+/// at ehdr, for the current thread now and for every thread started later.
+/// Threads already running when an object is loaded are not covered.
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void metalloc_register_thread_globals(void (*init)(), const void *ehdr) {
+    metaglobal_thread_init *thread_init =
+        (metaglobal_thread_init *)InternalAlloc(sizeof(metaglobal_thread_init));
+    thread_init->init = init;
+    thread_init->bias = ehdr ? object_bias((const ElfW(Ehdr) *)ehdr) : 0;
+    {
+        SpinMutexLock lock(&metaglobal_objects_lock);
+        thread_init->next = metaglobal_thread_inits;
+        __atomic_store_n(&metaglobal_thread_inits, thread_init, __ATOMIC_RELEASE);
+    }
+    register_thread_tls();
+    init();
+}
+
+/// Called by metastack on every new thread before its start routine.
+void metaglobal_thread_start() {
+    // Most programs have no tracked thread-local globals at all
+    if (__atomic_load_n(&metaglobal_thread_inits, __ATOMIC_RELAXED) == nullptr) {
+        return;
+    }
+    InternalMmapVector<void (*)()> inits(16);
+    {
+        SpinMutexLock lock(&metaglobal_objects_lock);
+        for (metaglobal_thread_init *thread_init = metaglobal_thread_inits; thread_init;
+                thread_init = thread_init->next) {
+            inits.push_back(thread_init->init);
+        }
+    }
+    register_thread_tls();
+    // The initializers touch TLS, which may take the loader lock, so they
+    // run outside of metaglobal_objects_lock
+    for (uptr i = 0; i < inits.size(); ++i) {
+        inits[i]();
+    }
+}
+
+/// Called by metastack once the thread's destructors have run.
+void metaglobal_thread_exit() {
+    thread_tls_skipped = false;
+    if (thread_tls_size == 0) {
+        return;
+    }
+    deallocate_category_metadata((void*)thread_tls_start, thread_tls_size, kMetaGlobalAlignBits, METALLOC_USAGE_GLOBALS);
+    set_metapagetable_entries((void*)thread_tls_start, thread_tls_size, 0, 0);
+    thread_tls_start = 0;
+    thread_tls_size = 0;
+}
+
+/// Release the metadata of an object once dlclose actually unmaps it.
+INTERCEPTOR(int, dlclose, void *handle) {
+    struct link_map *map = nullptr;
+    if (handle == nullptr || dlinfo(handle, RTLD_DI_LINKMAP, &map) != 0 || map == nullptr) {
+        return REAL(dlclose)(handle);
+    }
+    unsigned long bias = map->l_addr;
+    int result = REAL(dlclose)(handle);
+    if (result != 0) {
+        return result;
+    }
+    const ElfW(Ehdr) *ehdr;
+    {
+        SpinMutexLock lock(&metaglobal_objects_lock);
+        metaglobal_object *object = *metaglobal_object_find(bias);
+        if (!object) {
+            return result;
+        }
+        ehdr = object->ehdr;
+    }
+    // Still mapped if other handles keep the object loaded. The loader lock
+    // taken by dladdr is held while constructors register objects, so it
+    // must not be taken under metaglobal_objects_lock.
+    Dl_info info;
+    if (dladdr(ehdr, &info) != 0) {
+        return result;
+    }
+    metaglobal_object *object;
+    {
+        SpinMutexLock lock(&metaglobal_objects_lock);
+        metaglobal_object **link = metaglobal_object_find(bias);
+        object = *link;
+        if (!object || object->ehdr != ehdr) {
+            return result;
+        }
+        *link = object->next;
+        metaglobal_thread_init **thread_link = &metaglobal_thread_inits;
+        while (*thread_link) {
+            metaglobal_thread_init *thread_init = *thread_link;
+            if (thread_init->bias == bias) {
+                *thread_link = thread_init->next;
+                InternalFree(thread_init);
+            } else {
+                thread_link = &thread_init->next;
+            }
+        }
+    }
+    release_object(object);
+    return result;
 }
 
 extern "C" __attribute__((visibility("default")))
@@ -57,7 +406,9 @@ extern "C" __attribute__((visibility("default")))
 __attribute__((constructor(0)))
 #endif
 void __metaglobal_init() {
-    metalloc_init_globals((unsigned long)&__executable_start);
+    InitTlsSize();
+    register_object((const ElfW(Ehdr) *)&__executable_start);
+    INTERCEPT_FUNCTION(dlclose);
 }
                
 #if SANITIZER_CAN_USE_PREINIT_ARRAY
@@ -1,6 +1,29 @@
 #ifndef METAPAGETABLE_CORE_H
 #define METAPAGETABLE_CORE_H
 
+// USDT probes of the "typesan" provider, for perf and bpftrace (see
+// compiler-rt/lib/typesan/scripts/probes). A probe is a single nop until a
+// tracer attaches to it; without <sys/sdt.h>, or with METALLOC_NO_PROBES,
+// probes compile to nothing.
+#if defined(__has_include) && !defined(METALLOC_NO_PROBES)
+# if __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define METALLOC_HAS_PROBES 1
+# endif
+#endif
+
+#ifdef METALLOC_HAS_PROBES
+# define METALLOC_PROBE1(name, a) DTRACE_PROBE1(typesan, name, a)
+# define METALLOC_PROBE2(name, a, b) DTRACE_PROBE2(typesan, name, a, b)
+# define METALLOC_PROBE3(name, a, b, c) DTRACE_PROBE3(typesan, name, a, b, c)
+# define METALLOC_PROBE4(name, a, b, c, d) DTRACE_PROBE4(typesan, name, a, b, c, d)
+#else
+# define METALLOC_PROBE1(name, a) do { } while (0)
+# define METALLOC_PROBE2(name, a, b) do { } while (0)
+# define METALLOC_PROBE3(name, a, b, c) do { } while (0)
+# define METALLOC_PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -11,13 +34,117 @@ extern "C" {
 #define METALLOC_FIXEDSHIFT 3
 #define METALLOC_FIXEDSIZE (1 << METALLOC_FIXEDSHIFT)
 
+// Flags for tc_metalloc_malloc/tc_metalloc_new: the caller writes the
+// object metadata itself, so the allocator skips clearing it
+#define METALLOC_ALLOC_NOCLEAR 1
+
+// How the allocator carries METALLOC_ALLOC_NOCLEAR internally, in the top
+// bit of the size; never passed to the public entry points
+#define METALLOC_NOCLEAR_FLAG ((unsigned long)1 << 63)
+
+#define METALLOC_PAGETABLE 0x400000000000UL
+// Granule entries hold the metadata base above the alignment byte
+#define METALLOC_ENTRYBASESHIFT 8
+#define METALLOC_ENTRYALIGNMASK 0xFF
+// Metadata records are (allocation base, typeinfo) pairs
+#define METALLOC_METADATASHIFT 4
+
 //extern unsigned long pageTable[];
-#define pageTable ((unsigned long*)(0x400000000000))
+#define pageTable ((unsigned long*)(METALLOC_PAGETABLE))
+
+// Page-table entries come in two flavours, selected by bit 7 of the entry.
+// Granule entries hold (metaptr << 8) | alignment and index the metadata
+// in units of (1 << alignment) bytes.  Object entries are used for size
+// classes that are not a power of two and index one metadata entry per
+// object through the reciprocal of the object size:
+//   [63:20] metaptr >> 3 of the first object overlapping the page
+//   [19:8]  distance from the start of that object to the page start
+//   [7]     METALLOC_OBJECTFLAG
+//   [6:0]   object class, index into metalloc_object_reciprocals
+#define METALLOC_OBJECTFLAG 0x80
+#define METALLOC_OBJECTCLASSES 128
+#define METALLOC_OBJECTMAXSIZE METALLOC_PAGESIZE
+#define METALLOC_OBJECTPHASESHIFT 8
+#define METALLOC_OBJECTPHASEMASK (METALLOC_PAGESIZE - 1)
+#define METALLOC_OBJECTMETASHIFT 20
+#define METALLOC_OBJECTRECIPROCALSHIFT 32
+
+extern unsigned int metalloc_object_reciprocals[METALLOC_OBJECTCLASSES];
+
+static inline char *metapagetable_entry_base(unsigned long entry) {
+    if (entry & METALLOC_OBJECTFLAG)
+        return (char*)((entry >> METALLOC_OBJECTMETASHIFT) << 3);
+    return (char*)(entry >> METALLOC_ENTRYBASESHIFT);
+}
+
+// Index of the metadata entry for ptr, relative to the entry base
+static inline unsigned long metapagetable_entry_index(unsigned long entry, unsigned long ptr) {
+    unsigned long pageOffset = ptr & (METALLOC_PAGESIZE - 1);
+    if (entry & METALLOC_OBJECTFLAG) {
+        unsigned long objectOffset = pageOffset + ((entry >> METALLOC_OBJECTPHASESHIFT) & METALLOC_OBJECTPHASEMASK);
+        return (objectOffset * metalloc_object_reciprocals[entry & (METALLOC_OBJECTCLASSES - 1)]) >> METALLOC_OBJECTRECIPROCALSHIFT;
+    }
+    return pageOffset >> (entry & METALLOC_ENTRYALIGNMASK);
+}
+
+// Number of metadata entries describing an object of the given size
+static inline unsigned long metapagetable_entry_count(unsigned long entry, unsigned long size) {
+    if (entry & METALLOC_OBJECTFLAG)
+        return 1;
+    unsigned long alignment = entry & METALLOC_ENTRYALIGNMASK;
+    return (size + ((unsigned long)1 << alignment) - 1) >> alignment;
+}
 extern int is_fixed_compression();
 extern void page_table_init();
 extern void* allocate_metadata(unsigned long size, unsigned long alignment);
 extern void deallocate_metadata(void *ptr, unsigned long size, unsigned long alignment);
+extern void* allocate_category_metadata(unsigned long size, unsigned long alignment, int category);
+extern void deallocate_category_metadata(void *ptr, unsigned long size, unsigned long alignment, int category);
+extern void *allocate_span_metadata(unsigned long size);
+extern void deallocate_span_metadata(void *ptr);
 extern void set_metapagetable_entries(void *ptr, unsigned long size, void *metaptr, int alignment);
+extern int get_metapagetable_object_class(unsigned long objsize);
+extern void set_metapagetable_object_entries(void *ptr, unsigned long size, void *metaptr, unsigned long objsize, int objclass);
+extern void *get_metapagetable_metabase(void *ptr);
+
+// Memory held for metadata, by what the metadata describes. Reserved bytes
+// are address space set aside for a category, committed bytes the part of it
+// handed out, an upper bound on what the category keeps resident. For the
+// page table, which is reserved whole and touched sparsely, committed counts
+// the pages entries were written to. METALLOC_USAGE_ARENA covers arena
+// space not handed out yet and freed blocks waiting for reuse.
+enum metalloc_usage_category {
+    METALLOC_USAGE_PAGETABLE,
+    METALLOC_USAGE_SPANS,
+    METALLOC_USAGE_STACKS,
+    METALLOC_USAGE_GLOBALS,
+    METALLOC_USAGE_SAFESTACK,
+    METALLOC_USAGE_OTHER,
+    METALLOC_USAGE_ARENA,
+    METALLOC_USAGE_CATEGORIES
+};
+
+struct metalloc_usage {
+    unsigned long reserved;
+    unsigned long committed;
+};
+
+extern void metalloc_get_usage(struct metalloc_usage usage[METALLOC_USAGE_CATEGORIES]);
+extern const char *metalloc_usage_category_name(int category);
+// Formats the usage table into buffer, returns the length written
+extern int metalloc_print_usage(char *buffer, int length);
+
+struct metalloc_typed_pool {
+    void *head;
+    unsigned long count;
+    // Next pool the owning thread has cached objects in, NULL until then
+    struct metalloc_typed_pool *next;
+};
+
+extern void *metalloc_typed_malloc(unsigned long size, unsigned long typeinfo);
+extern void *metalloc_typed_new(unsigned long size, unsigned long typeinfo);
+extern void *metalloc_typed_pool_new(unsigned long size, unsigned long typeinfo, struct metalloc_typed_pool *pool);
+extern void metalloc_typed_pool_delete(void *ptr, unsigned long size, unsigned long typeinfo, struct metalloc_typed_pool *pool);
 extern unsigned long get_metapagetable_entry(void *ptr);
 extern void allocate_metapagetable_entries(void *ptr, unsigned long size);
 extern void deallocate_metapagetable_entries(void *ptr, unsigned long size);
@@ -10,21 +10,28 @@
 // This file implements the runtime support for the safe stack protection
 // mechanism. The runtime manages allocation/deallocation of the unsafe stack
 // for the main thread, as well as all pthreads that are created/destroyed
-// during program execution.
+// during program execution. Stacks of exited threads are pooled together with
+// their metadata so that thread churn does not keep remapping them. Fibers,
+// whether switched through ucontext or by hand, get a tracked stack each.
 //
 //===----------------------------------------------------------------------===//
 
 #include <limits.h>
 #include <pthread.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/user.h>
+#include <ucontext.h>
 
 #include "interception/interception.h"
+#include "sanitizer_common/sanitizer_allocator_internal.h"
 #include "sanitizer_common/sanitizer_common.h"
+#include "sanitizer_common/sanitizer_libc.h"
+#include "sanitizer_common/sanitizer_mutex.h"
 
 #include "metapagetable_core.h"
 
@@ -64,14 +71,29 @@
 // such accesses faster. Alternatively, dedicating a separate register for
 // storing it would also be possible.
 
-/// Minimum stack alignment for the unsafe stack.
-const unsigned kMetaStackAlignBits = 6;
-const unsigned kMetaStackAlign = 1 << kMetaStackAlignBits;
+/// Default alignment of tracked stack objects, which is also the granularity
+/// of their metadata. Matches the -typesan-stack-align-bits default; modules
+/// built with another value say so through __metastack_align_bits, which
+/// fails to link when objects of one binary disagree on it.
+const unsigned kMetaStackDefaultAlignBits = 4;
+
+extern "C" __attribute__((weak)) const unsigned __metastack_align_bits;
+
+/// Alignment of the tracked stack in use, set up by __metastack_init
+static unsigned metaStackAlignBits;
+static size_t metaStackAlign;
 
 /// Default size of the unsafe stack. This value is only used if the stack
 /// size rlimit is set to infinity.
 const unsigned kDefaultTrackedStackSize = 0x2800000;
 
+/// Maximum number of released tracked stacks kept for reuse by new threads.
+const unsigned kTrackedStackPoolMax = 64;
+
+/// Number of bytes at the top of a pooled tracked stack that stay committed
+/// while it waits for a new thread; the rest is handed back to the kernel.
+const size_t kTrackedStackPoolHotSize = 0x10000;
+
 /// Runtime page size obtained through sysconf
 static unsigned pageSize;
 
@@ -96,19 +118,92 @@ static __thread size_t unsafe_stack_size = 0;
 static __thread size_t unsafe_stack_guard = 0;
 
 static inline void unsafe_stack_alloc_meta(void *addr, unsigned long size) {
-    unsigned long alignment = kMetaStackAlignBits;
-    void *metadata = allocate_metadata(size, alignment);
+    unsigned long alignment = metaStackAlignBits;
+    void *metadata = allocate_category_metadata(size, alignment, METALLOC_USAGE_STACKS);
     set_metapagetable_entries(addr, size, metadata, alignment);
 }
 
 static inline void unsafe_stack_free_meta(void *unsafe_stack_start, unsigned long unsafe_stack_size) {
-    unsigned long alignment = kMetaStackAlignBits;
-    deallocate_metadata(unsafe_stack_start, unsafe_stack_size, alignment);
+    unsigned long alignment = metaStackAlignBits;
+    deallocate_category_metadata(unsafe_stack_start, unsafe_stack_size, alignment, METALLOC_USAGE_STACKS);
+}
+
+/// Released tracked stack waiting for reuse. The node lives at the top of the
+/// stack it describes, so the pool needs no memory of its own.
+struct tracked_stack_pool_entry {
+  tracked_stack_pool_entry *next;
+  size_t size;
+  size_t guard;
+};
+
+static StaticSpinMutex tracked_stack_pool_lock;
+static tracked_stack_pool_entry *tracked_stack_pool;
+static unsigned tracked_stack_pool_count;
+
+static inline tracked_stack_pool_entry *unsafe_stack_pool_node(void *addr,
+                                                               size_t size) {
+  return (tracked_stack_pool_entry *)((char *)addr + size -
+                                      sizeof(tracked_stack_pool_entry));
+}
+
+/// Take a pooled stack with matching geometry; its guard page is already in
+/// place and its metadata is still registered in the page table.
+static void *unsafe_stack_pool_get(size_t size, size_t guard) {
+  SpinMutexLock lock(&tracked_stack_pool_lock);
+  tracked_stack_pool_entry **link = &tracked_stack_pool;
+  for (tracked_stack_pool_entry *entry = *link; entry;
+       link = &entry->next, entry = *link) {
+    if (entry->size != size || entry->guard != guard)
+      continue;
+    *link = entry->next;
+    tracked_stack_pool_count--;
+    return (char *)entry + sizeof(tracked_stack_pool_entry) - size;
+  }
+  return nullptr;
+}
+
+/// Park a stack for the next thread. Returns false if the pool is full.
+static bool unsafe_stack_pool_put(void *addr, size_t size, size_t guard) {
+  // Keep the hot top of the stack resident and drop the rest; the pages
+  // fault back in zero-filled if a later thread recurses that deep.
+  if (size > kTrackedStackPoolHotSize) {
+    uptr cold_size = size - kTrackedStackPoolHotSize;
+    FlushUnneededShadowMemory((uptr)addr, cold_size);
+    // The stack's metadata is one block, so that of the dropped pages is a
+    // single range; its whole pages go as well and read back as zero
+    uptr start_entry = pageTable[(uptr)addr >> METALLOC_PAGESHIFT];
+    uptr end_entry = pageTable[((uptr)addr + cold_size) >> METALLOC_PAGESHIFT];
+    uptr meta_start = (uptr)metapagetable_entry_base(start_entry) +
+        2 * sizeof(uptr) * metapagetable_entry_index(start_entry, (uptr)addr);
+    uptr meta_end = (uptr)metapagetable_entry_base(end_entry) +
+        2 * sizeof(uptr) * metapagetable_entry_index(end_entry, (uptr)addr + cold_size);
+    meta_start = RoundUpTo(meta_start, pageSize);
+    meta_end = RoundDownTo(meta_end, pageSize);
+    if (meta_end > meta_start)
+      FlushUnneededShadowMemory(meta_start, meta_end - meta_start);
+  }
+
+  SpinMutexLock lock(&tracked_stack_pool_lock);
+  if (tracked_stack_pool_count >= kTrackedStackPoolMax)
+    return false;
+  tracked_stack_pool_entry *entry = unsafe_stack_pool_node(addr, size);
+  entry->next = tracked_stack_pool;
+  entry->size = size;
+  entry->guard = guard;
+  tracked_stack_pool = entry;
+  tracked_stack_pool_count++;
+  return true;
 }
 
 static inline void *unsafe_stack_alloc(size_t size, size_t guard) {
   CHECK_GE(size + guard, size);
-  void *addr = MmapOrDie(size + guard, "tracked_stack_alloc");
+  if (void *addr = unsafe_stack_pool_get(size, guard))
+    return addr;
+
+  // Like any anonymous mapping, stack pages are only backed once touched;
+  // MAP_NORESERVE also keeps the reservation out of the commit charge under
+  // strict overcommit accounting.
+  void *addr = MmapNoReserveOrDie(size + guard, "tracked_stack_alloc");
   MprotectNoAccess((uptr)addr, (uptr)guard);
   unsafe_stack_alloc_meta((char *)addr + guard, size);
   
@@ -119,23 +214,141 @@ static inline void unsafe_stack_setup(void *start, size_t size, size_t guard) {
   CHECK_GE((char *)start + size, (char *)start);
   CHECK_GE((char *)start + guard, (char *)start);
   void *stack_ptr = (char *)start + size;
-  CHECK_EQ((((size_t)stack_ptr) & (kMetaStackAlign - 1)), 0);
+  CHECK_EQ((((size_t)stack_ptr) & (metaStackAlign - 1)), 0);
   
   __metastack_tracked_stack_ptr = stack_ptr;
   unsafe_stack_start = start;
   unsafe_stack_size = size;
   unsafe_stack_guard = guard;
+  METALLOC_PROBE3(stack__setup, start, size, guard);
 }
 
-static void unsafe_stack_free() {
-  if (unsafe_stack_start) {
-    UnmapOrDie((char *)unsafe_stack_start - unsafe_stack_guard,
-               unsafe_stack_size + unsafe_stack_guard);
-    unsafe_stack_free_meta(unsafe_stack_start, unsafe_stack_size);
+static void unsafe_stack_release(void *addr, size_t size, size_t guard) {
+  if (!unsafe_stack_pool_put(addr, size, guard)) {
+    UnmapOrDie((char *)addr - guard, size + guard);
+    unsafe_stack_free_meta(addr, size);
   }
+}
+
+static void unsafe_stack_free() {
+  METALLOC_PROBE2(stack__free, unsafe_stack_start, unsafe_stack_size);
+  if (unsafe_stack_start)
+    unsafe_stack_release(unsafe_stack_start, unsafe_stack_size,
+                         unsafe_stack_guard);
   unsafe_stack_start = nullptr;
 }
 
+/// Arguments forwarded by the makecontext interceptor; the first six are
+/// passed in registers, the rest on the context's native stack
+const int kContextMaxArgs = 16;
+
+/// Tracked stack of a fiber, kept at the top of that stack. While a fiber is
+/// switched out, stack_ptr holds its tracked stack pointer.
+struct metastack_fiber {
+  void *stack_ptr;
+  void *start;
+  size_t size;
+  size_t guard;
+
+  // Set for fibers created by the makecontext interceptor
+  ucontext_t *context;
+  metastack_fiber *context_next;
+  void (*func)();
+  long args[kContextMaxArgs];
+};
+
+/// Fiber running on this thread; nullptr while on the thread's own stack,
+/// whose tracked stack pointer is then kept in thread_stack_ptr.
+static __thread metastack_fiber *current_fiber = nullptr;
+static __thread void *thread_stack_ptr = nullptr;
+
+static void fiber_reset(metastack_fiber *fiber) {
+  fiber->stack_ptr =
+      (void *)((uptr)fiber & ~(uptr)(metaStackAlign - 1));
+}
+
+static metastack_fiber *fiber_alloc(size_t size) {
+  size = RoundUpTo(size, pageSize);
+  CHECK_GE(size, pageSize);
+  void *addr = unsafe_stack_alloc(size, pageSize);
+  metastack_fiber *fiber = (metastack_fiber *)((char *)addr + size -
+                                               sizeof(metastack_fiber));
+  internal_memset(fiber, 0, sizeof(*fiber));
+  fiber->start = addr;
+  fiber->size = size;
+  fiber->guard = pageSize;
+  fiber_reset(fiber);
+  return fiber;
+}
+
+static void fiber_free(metastack_fiber *fiber) {
+  CHECK_NE(fiber, current_fiber);
+  unsafe_stack_release(fiber->start, fiber->size, fiber->guard);
+}
+
+static inline void fiber_switch(metastack_fiber *to) {
+  void *stack_ptr = __metastack_tracked_stack_ptr;
+  if (current_fiber)
+    current_fiber->stack_ptr = stack_ptr;
+  else
+    thread_stack_ptr = stack_ptr;
+  __metastack_tracked_stack_ptr = to ? to->stack_ptr : thread_stack_ptr;
+  current_fiber = to;
+}
+
+/// Fibers created by makecontext, keyed by their ucontext, so that remaking
+/// a context reuses its tracked stack. Only makecontext and context release
+/// look here; switches go through the fiber pointers kept on native stacks.
+const unsigned kContextFiberBuckets = 1024;
+static StaticSpinMutex context_fibers_lock;
+static metastack_fiber *context_fibers[kContextFiberBuckets];
+
+static metastack_fiber **context_fiber_find(const ucontext_t *ucp) {
+  metastack_fiber **link =
+      &context_fibers[((uptr)ucp >> 4) % kContextFiberBuckets];
+  while (*link && (*link)->context != ucp)
+    link = &(*link)->context_next;
+  return link;
+}
+
+/// Unlink and return the fiber made for ucp, if any
+static metastack_fiber *context_fiber_remove(const ucontext_t *ucp) {
+  SpinMutexLock lock(&context_fibers_lock);
+  metastack_fiber **link = context_fiber_find(ucp);
+  metastack_fiber *fiber = *link;
+  if (fiber)
+    *link = fiber->context_next;
+  return fiber;
+}
+
+static void context_fiber_insert(metastack_fiber *fiber) {
+  SpinMutexLock lock(&context_fibers_lock);
+  metastack_fiber **link = context_fiber_find(fiber->context);
+  fiber->context_next = *link;
+  *link = fiber;
+}
+
+/// Entry point of contexts set up by makecontext. Whoever switched here left
+/// its own tracked stack in place, so take over from it first. When the
+/// context function returns, glibc resumes uc_link, which restores its own
+/// tracked stack the same way.
+static void fiber_start(metastack_fiber *fiber) {
+  fiber_switch(fiber);
+  // The caller pops stack-passed arguments, so passing all of them is fine
+  // for functions taking fewer.
+  typedef void (*context_func)(long, long, long, long, long, long, long, long,
+                               long, long, long, long, long, long, long, long);
+  long *args = fiber->args;
+  ((context_func)fiber->func)(args[0], args[1], args[2], args[3], args[4],
+                              args[5], args[6], args[7], args[8], args[9],
+                              args[10], args[11], args[12], args[13],
+                              args[14], args[15]);
+}
+
+/// Metadata for tracked thread-local globals, defined in metaglobal.cc
+void metaglobal_thread_start();
+void metaglobal_thread_exit();
+
 /// Thread data for the cleanup handler
 static pthread_key_t thread_cleanup_key;
 
@@ -166,6 +379,8 @@ static void *thread_start(void *arg) {
   // intercepting the pthread_setspecific function itself
   pthread_setspecific(thread_cleanup_key, (void *)1);
 
+  metaglobal_thread_start();
+
   return start_routine(start_routine_arg);
 }
 
@@ -180,6 +395,7 @@ static void thread_cleanup_handler(void *_iter) {
     pthread_setspecific(thread_cleanup_key, (void *)(iter + 1));
   } else {
     // This is the last iteration
+    metaglobal_thread_exit();
     unsafe_stack_free();
   }
 }
@@ -205,7 +421,7 @@ INTERCEPTOR(int, pthread_create, pthread_t *thread,
   }
   
   CHECK_NE(size, 0);
-  CHECK_EQ((size & (kMetaStackAlign - 1)), 0);
+  CHECK_EQ((size & (metaStackAlign - 1)), 0);
   CHECK_EQ((guard & (pageSize - 1)), 0);
 
   void *addr = unsafe_stack_alloc(size, guard);
@@ -217,7 +433,52 @@ INTERCEPTOR(int, pthread_create, pthread_t *thread,
   tinfo->unsafe_stack_size = size;
   tinfo->unsafe_stack_guard = guard;
 
-  return REAL(pthread_create)(thread, attr, thread_start, tinfo);
+  int result = REAL(pthread_create)(thread, attr, thread_start, tinfo);
+  if (result != 0)
+    unsafe_stack_release(addr, size, guard);
+  return result;
+}
+
+/// Give each context created by makecontext a tracked stack of the same size
+/// as its native stack. Remaking a context reuses its tracked stack.
+INTERCEPTOR(void, makecontext, ucontext_t *ucp, void (*func)(), int argc,
+            ...) {
+  // glibc reads the arguments as greg_t; forward them the same way.
+  if (argc > kContextMaxArgs) {
+    Report("ERROR: metastack: makecontext with %d arguments, at most %d are "
+           "supported\n", argc, kContextMaxArgs);
+    Die();
+  }
+  metastack_fiber *fiber = context_fiber_remove(ucp);
+  if (fiber && fiber->size < ucp->uc_stack.ss_size) {
+    fiber_free(fiber);
+    fiber = nullptr;
+  }
+  if (fiber) {
+    fiber_reset(fiber);
+  } else {
+    fiber = fiber_alloc(ucp->uc_stack.ss_size);
+    fiber->context = ucp;
+  }
+  context_fiber_insert(fiber);
+  fiber->func = func;
+  va_list ap;
+  va_start(ap, argc);
+  for (int i = 0; i < kContextMaxArgs; i++)
+    fiber->args[i] = i < argc ? va_arg(ap, long) : 0;
+  va_end(ap);
+  REAL(makecontext)(ucp, (void (*)())fiber_start, 1, fiber);
+}
+
+/// The tracked stack is switched on the resuming side: the target either
+/// starts in fiber_start or returns from its own swapcontext below, and puts
+/// back the fiber it was running on. setcontext needs no interceptor for the
+/// same reason.
+INTERCEPTOR(int, swapcontext, ucontext_t *oucp, const ucontext_t *ucp) {
+  metastack_fiber *from = current_fiber;
+  int result = REAL(swapcontext)(oucp, ucp);
+  fiber_switch(from);
+  return result;
 }
 
 extern "C" __attribute__((visibility("default")))
@@ -226,6 +487,10 @@ extern "C" __attribute__((visibility("default")))
 __attribute__((constructor(0)))
 #endif
 void __metastack_init() {
+  metaStackAlignBits = &__metastack_align_bits ? __metastack_align_bits
+                                               : kMetaStackDefaultAlignBits;
+  metaStackAlign = (size_t)1 << metaStackAlignBits;
+
   // Determine the stack size for the main thread.
   size_t size = kDefaultTrackedStackSize;
   size_t guard = 4096;
@@ -243,6 +508,10 @@ void __metastack_init() {
   // Initialize pthread interceptors for thread allocation
   INTERCEPT_FUNCTION(pthread_create);
 
+  // Initialize ucontext interceptors for fiber switching
+  INTERCEPT_FUNCTION(makecontext);
+  INTERCEPT_FUNCTION(swapcontext);
+
   // Setup the cleanup handler
   pthread_key_create(&thread_cleanup_key, thread_cleanup_handler);
 }
@@ -259,7 +528,40 @@ __attribute__((section(".preinit_array"),
 
 extern "C"
     __attribute__((visibility("default"))) void *__get_tracked_stack_start() {
-  return unsafe_stack_start;
+  return current_fiber ? current_fiber->start : unsafe_stack_start;
+}
+
+/// Fiber API for code that switches native stacks by hand: create a tracked
+/// stack per fiber and call __metastack_fiber_switch next to each native stack
+/// switch. Switching to nullptr returns to the thread's own tracked stack.
+extern "C" __attribute__((visibility("default")))
+void *__metastack_fiber_create(size_t size) {
+  CHECK_NE(size, 0);
+  return fiber_alloc(size);
+}
+
+extern "C" __attribute__((visibility("default")))
+void __metastack_fiber_destroy(void *fiber) {
+  if (fiber)
+    fiber_free((metastack_fiber *)fiber);
+}
+
+extern "C" __attribute__((visibility("default")))
+void __metastack_fiber_switch(void *fiber) {
+  fiber_switch((metastack_fiber *)fiber);
+}
+
+extern "C" __attribute__((visibility("default")))
+void *__metastack_fiber_current() {
+  return current_fiber;
+}
+
+/// Forget a ucontext before its memory is freed, releasing the tracked stack
+/// makecontext created for it. See sanitizer/metastack_interface.h.
+extern "C" __attribute__((visibility("default")))
+void __metastack_context_release(ucontext_t *ucp) {
+  if (metastack_fiber *fiber = context_fiber_remove(ucp))
+    fiber_free(fiber);
 }
 
 extern "C"
@@ -1,5 +1,7 @@
 #include "sanitizer_common/sanitizer_common.h"
 
+#include "metapagetable_core.h"
+
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
 void metalloc_widememset(unsigned long *base, unsigned long size, unsigned long value1, unsigned long value2) {
     for (unsigned long i = 0; i < size; ++i) {
@@ -7,3 +9,32 @@ void metalloc_widememset(unsigned long *base, unsigned long size, unsigned long
         base[2 * i + 1] = value2;
     }
 }
+
+// Metadata entries of a tracked stack are contiguous, so one page-table lookup
+// for the frame bottom covers every object in the frame.
+static inline unsigned long *metalloc_stack_metadata(unsigned long ptr) {
+    unsigned long entry = pageTable[ptr >> METALLOC_PAGESHIFT];
+    return (unsigned long *)metapagetable_entry_base(entry) +
+        2 * metapagetable_entry_index(entry, ptr);
+}
+
+// Stamp a frame template emitted by MetaStack: tmpl[0] records of
+// (first granule, granule count, typeinfo), relative to the frame bottom
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void metalloc_stamp_frame(unsigned long frame, const unsigned long *tmpl) {
+    unsigned long alignment = pageTable[frame >> METALLOC_PAGESHIFT] & 0xFF;
+    unsigned long *metadata = metalloc_stack_metadata(frame);
+    for (unsigned long i = 0, n = tmpl[0]; i < n; ++i) {
+        const unsigned long *record = &tmpl[1 + 3 * i];
+        metalloc_widememset(metadata + 2 * record[0], record[1],
+            frame + (record[0] << alignment), record[2]);
+    }
+}
+
+// Tracked object that MetaStack did not fold into a frame template
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void metalloc_frame_object(void *ptr, unsigned long typeinfo, unsigned long size) {
+    unsigned long entry = pageTable[(unsigned long)ptr >> METALLOC_PAGESHIFT];
+    metalloc_widememset(metalloc_stack_metadata((unsigned long)ptr),
+        metapagetable_entry_count(entry, size), (unsigned long)ptr, typeinfo);
+}
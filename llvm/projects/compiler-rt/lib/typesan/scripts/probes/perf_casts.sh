@@ -0,0 +1,30 @@
+#!/bin/sh
+#
+# perf_casts.sh - Record the TypeSan cast probes of BINARY with perf while
+# running CMD, and summarize them per probe.
+#
+# USAGE: perf_casts.sh BINARY CMD [ARGS...]
+#
+set -e
+if [ $# -lt 2 ]; then
+	echo "usage: $0 BINARY CMD [ARGS...]" >&2
+	exit 1
+fi
+binary="$1"
+shift
+
+# perf needs the binary in its build-id cache to find the probe notes
+perf buildid-cache --add "$binary"
+for probe in cast__slow cast__missing cast__bad; do
+	perf probe -q -d "sdt_typesan:$probe" 2>/dev/null || true
+	perf probe -q -x "$binary" "sdt_typesan:$probe"
+done
+
+perf record -q -o typesan-casts.data \
+	-e sdt_typesan:cast__slow -e sdt_typesan:cast__missing \
+	-e sdt_typesan:cast__bad -g -- "$@"
+perf report -i typesan-casts.data --stdio --sort sym,dso | head -60
+
+for probe in cast__slow cast__missing cast__bad; do
+	perf probe -q -d "sdt_typesan:$probe" 2>/dev/null || true
+done
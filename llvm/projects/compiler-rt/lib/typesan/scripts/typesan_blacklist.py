@@ -0,0 +1,175 @@
+#!/usr/bin/env python
+#===- lib/typesan/scripts/typesan_blacklist.py -----------------------------===#
+#
+#                     The LLVM Compiler Infrastructure
+#
+# This file is distributed under the University of Illinois Open Source
+# License. See LICENSE.TXT for details.
+#
+#===------------------------------------------------------------------------===#
+#
+# Derives a -fsanitize-blacklist file from the allocation profiles written
+# by code built with -mllvm -typesan-profile-allocs and run with
+# TYPESAN_OPTIONS=profile_path=<path> (the <path>.<pid>.allocs files).
+#
+#   typesan_blacklist.py [--casts PROFILE]... [--min-share PERCENT]
+#                        [-o OUT] ALLOCS...
+#
+# Only entries that lose no check on the profiled workload are emitted:
+#
+#   type:<mangled typeinfo name>  types that were allocated but never held
+#                                 an object a cast was checked on, and are
+#                                 never a cast destination in the --casts
+#                                 profiles
+#   fun:<function>=metadata       functions whose stack objects were never
+#                                 cast on; TypeSan leaves their objects
+#                                 untracked
+#
+# Entries are ordered by the metadata writes they save, estimated as one
+# page-table lookup per allocation plus one word per 8 bytes allocated.
+#
+#===------------------------------------------------------------------------===#
+import argparse
+import sys
+
+
+class AllocSite(object):
+  def __init__(self, type_hash, type_name, function, name):
+    self.type_hash = type_hash
+    self.type_name = type_name
+    self.function = function
+    self.name = name
+    self.allocs = 0
+    self.bytes = 0
+    self.casts = 0
+
+  def cost(self):
+    return self.allocs + self.bytes // 8
+
+  def is_stack(self):
+    return self.name.startswith('stack:')
+
+
+class Profile(object):
+  def __init__(self):
+    self.sites = {}
+    self.type_casts = {}
+    self.type_unattributed = {}
+    self.overflow = 0
+
+  def read(self, path):
+    with open(path) as f:
+      for number, line in enumerate(f, 1):
+        if line.startswith('#') or not line.strip():
+          continue
+        fields = line.rstrip('\n').split('\t')
+        try:
+          if fields[0] == 'site' and len(fields) == 8:
+            key = (fields[1], fields[3], fields[4])
+            site = self.sites.get(key)
+            if site is None:
+              site = AllocSite(fields[1], fields[2], fields[3], fields[4])
+              self.sites[key] = site
+            site.allocs += int(fields[5])
+            site.bytes += int(fields[6])
+            site.casts += int(fields[7])
+          elif fields[0] == 'type' and len(fields) == 4:
+            self.type_casts[fields[1]] = (self.type_casts.get(fields[1], 0) +
+                                          int(fields[2]))
+            self.type_unattributed[fields[1]] = (
+                self.type_unattributed.get(fields[1], 0) + int(fields[3]))
+          elif fields[0] == 'overflow' and len(fields) == 2:
+            self.overflow += int(fields[1])
+          else:
+            raise ValueError
+        except ValueError:
+          sys.stderr.write('%s:%d: malformed line, skipped\n' % (path, number))
+
+
+def read_cast_destinations(paths):
+  destinations = set()
+  for path in paths:
+    with open(path) as f:
+      for line in f:
+        if line.startswith('#') or not line.strip():
+          continue
+        fields = line.split('\t')
+        if len(fields) > 1:
+          destinations.add(fields[1])
+  return destinations
+
+
+def main():
+  parser = argparse.ArgumentParser(
+      description='Derive a TypeSan blacklist from allocation profiles.')
+  parser.add_argument('profiles', nargs='+', metavar='ALLOCS')
+  parser.add_argument('--casts', action='append', default=[],
+                      metavar='PROFILE',
+                      help='cast site profile of the same runs, to keep '
+                           'cast destination types tracked')
+  parser.add_argument('--min-share', type=float, default=0.1,
+                      metavar='PERCENT',
+                      help='leave out entries saving less than this share '
+                           'of the total estimated cost')
+  parser.add_argument('-o', '--output', help='output file, default stdout')
+  args = parser.parse_args()
+
+  profile = Profile()
+  for path in args.profiles:
+    profile.read(path)
+  destinations = read_cast_destinations(args.casts)
+  if not args.casts:
+    sys.stderr.write('warning: no --casts profile, cast destination types '
+                     'may be blacklisted\n')
+
+  sites = list(profile.sites.values())
+  total = sum(site.cost() for site in sites) or 1
+  entries = []
+
+  # Types whose casts could not all be counted cannot be trusted
+  if profile.overflow:
+    sys.stderr.write('warning: the type table overflowed, no type: entries\n')
+  types = {}
+  for site in sites:
+    types.setdefault(site.type_hash, []).append(site)
+  blacklisted_types = set()
+  for type_hash, type_sites in types.items():
+    if (profile.overflow or profile.type_casts.get(type_hash, 0) or
+        type_hash in destinations):
+      continue
+    blacklisted_types.add(type_hash)
+    entries.append((sum(site.cost() for site in type_sites),
+                    'type:' + type_sites[0].type_name))
+
+  # Casts on objects of unknown origin may have come from any function
+  functions = {}
+  for site in sites:
+    if site.is_stack():
+      functions.setdefault(site.function, []).append(site)
+  for function, function_sites in functions.items():
+    if any(site.casts or profile.type_unattributed.get(site.type_hash, 0)
+           for site in function_sites):
+      continue
+    cost = sum(site.cost() for site in function_sites
+               if site.type_hash not in blacklisted_types)
+    if cost:
+      entries.append((cost, 'fun:%s=metadata' % function))
+
+  entries.sort(key=lambda entry: (-entry[0], entry[1]))
+  entries = [entry for entry in entries
+             if 100.0 * entry[0] / total >= args.min_share]
+  saved = sum(entry[0] for entry in entries)
+
+  out = open(args.output, 'w') if args.output else sys.stdout
+  out.write('# Generated by typesan_blacklist.py from %d profile(s)\n' %
+            len(args.profiles))
+  out.write('# Estimated metadata writes saved: %d of %d (%.1f%%)\n' %
+            (saved, total, 100.0 * saved / total))
+  for cost, entry in entries:
+    out.write('# %.2f%%\n%s\n' % (100.0 * cost / total, entry))
+  if out is not sys.stdout:
+    out.close()
+
+
+if __name__ == '__main__':
+  main()
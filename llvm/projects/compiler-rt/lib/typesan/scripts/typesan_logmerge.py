@@ -0,0 +1,77 @@
+#!/usr/bin/env python
+#===- lib/typesan/scripts/typesan_logmerge.py ------------------------------===#
+#
+#                     The LLVM Compiler Infrastructure
+#
+# This file is distributed under the University of Illinois Open Source
+# License. See LICENSE.TXT for details.
+#
+#===------------------------------------------------------------------------===#
+#
+# Merges the compile-time statistics shards that every compiler invocation
+# writes to <log>.shards/ when built with TYPECHECK_LOGFILE=<log> into <log>,
+# and removes the merged shards.
+#
+#   typesan_logmerge.py [--keep] LOG
+#
+# Shards and the log share one format: the static downcast, tracked stack,
+# tracked global and tracked heap counts, one per line, followed by pairs of
+# lines holding a class hash and its name.
+#
+#===------------------------------------------------------------------------===#
+import argparse
+import os
+import sys
+
+COUNTERS = 4
+
+
+def read_log(path, counters, names):
+  with open(path) as f:
+    lines = f.read().splitlines()
+  if len(lines) < COUNTERS or (len(lines) - COUNTERS) % 2:
+    sys.stderr.write('%s: malformed, skipped\n' % path)
+    return False
+  for i in range(COUNTERS):
+    counters[i] += int(lines[i])
+  for i in range(COUNTERS, len(lines), 2):
+    names.setdefault(int(lines[i]), lines[i + 1])
+  return True
+
+
+def main():
+  parser = argparse.ArgumentParser(
+      description='Merge TypeSan compile-time statistics shards.')
+  parser.add_argument('log', metavar='LOG')
+  parser.add_argument('--keep', action='store_true',
+                      help='keep the shards after merging them')
+  args = parser.parse_args()
+
+  counters = [0] * COUNTERS
+  names = {}
+  if os.path.exists(args.log) and not read_log(args.log, counters, names):
+    sys.exit(1)
+  shard_dir = args.log + '.shards'
+  merged = []
+  if os.path.isdir(shard_dir):
+    # Shards still being written have a .tmp suffix
+    for name in sorted(os.listdir(shard_dir)):
+      path = os.path.join(shard_dir, name)
+      if name.endswith('.shard') and read_log(path, counters, names):
+        merged.append(path)
+
+  tmp = args.log + '.tmp'
+  with open(tmp, 'w') as f:
+    for value in counters:
+      f.write('%d\n' % value)
+    for key in sorted(names):
+      f.write('%d\n%s\n' % (key, names[key]))
+  os.rename(tmp, args.log)
+  if not args.keep:
+    for path in merged:
+      os.remove(path)
+  sys.stderr.write('merged %d shard(s) into %s\n' % (len(merged), args.log))
+
+
+if __name__ == '__main__':
+  main()
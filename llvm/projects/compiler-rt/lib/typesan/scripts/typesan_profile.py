@@ -0,0 +1,101 @@
+#!/usr/bin/env python
+#===- lib/typesan/scripts/typesan_profile.py -------------------------------===#
+#
+#                     The LLVM Compiler Infrastructure
+#
+# This file is distributed under the University of Illinois Open Source
+# License. See LICENSE.TXT for details.
+#
+#===------------------------------------------------------------------------===#
+#
+# Merges the per-cast-site profiles written by TypeSan with
+# TYPESAN_OPTIONS=profile_path=<path> (one <path>.<pid> file per process) and lists the
+# sites by cost, with their source location.
+#
+#   typesan_profile.py [--sort exec|slow|bad|missing] [--top N]
+#                      [--merge OUT] PROFILE...
+#
+#===------------------------------------------------------------------------===#
+import argparse
+import sys
+
+HEADER = ('# typesan-profile 1\n'
+          '# key\tdst\tfile\tline\tcolumn\texec\tnull\tmissing\texact\tslow\tbad\n')
+COUNTERS = ['exec', 'null', 'missing', 'exact', 'slow', 'bad']
+
+
+class Site(object):
+  def __init__(self, key, dst, filename, line, column):
+    self.key = key
+    self.dst = dst
+    self.filename = filename
+    self.line = line
+    self.column = column
+    self.counts = dict((name, 0) for name in COUNTERS)
+
+  def location(self):
+    return '%s:%d:%d' % (self.filename, self.line, self.column)
+
+
+def read_profile(path, sites):
+  with open(path) as f:
+    for number, line in enumerate(f, 1):
+      if line.startswith('#') or not line.strip():
+        continue
+      fields = line.rstrip('\n').split('\t')
+      if len(fields) != 5 + len(COUNTERS):
+        sys.stderr.write('%s:%d: malformed line, skipped\n' % (path, number))
+        continue
+      key = fields[0]
+      # Sites of a DSO loaded more than once appear once per load
+      site = sites.get(key)
+      if site is None:
+        site = Site(key, fields[1], fields[2], int(fields[3]), int(fields[4]))
+        sites[key] = site
+      for name, value in zip(COUNTERS, fields[5:]):
+        site.counts[name] += int(value)
+
+
+def write_profile(path, sites):
+  with open(path, 'w') as f:
+    f.write(HEADER)
+    for site in sites:
+      f.write('\t'.join([site.key, site.dst, site.filename, str(site.line),
+                         str(site.column)] +
+                        [str(site.counts[name]) for name in COUNTERS]) + '\n')
+
+
+def main():
+  parser = argparse.ArgumentParser(
+      description='Merge and rank TypeSan cast site profiles.')
+  parser.add_argument('profiles', nargs='+', metavar='PROFILE')
+  parser.add_argument('--sort', choices=['exec', 'slow', 'bad', 'missing'],
+                      default='exec', help='counter to rank sites by')
+  parser.add_argument('--top', type=int, default=50,
+                      help='number of sites to list, 0 for all')
+  parser.add_argument('--merge', metavar='OUT',
+                      help='also write the merged profile to OUT')
+  args = parser.parse_args()
+
+  sites = {}
+  for path in args.profiles:
+    read_profile(path, sites)
+  ranked = sorted(sites.values(),
+                  key=lambda site: (-site.counts[args.sort], site.location()))
+  if args.merge:
+    write_profile(args.merge, ranked)
+
+  total = sum(site.counts['exec'] for site in ranked) or 1
+  print('%12s %7s %12s %12s %12s  %s' %
+        ('exec', '%exec', 'slow', 'bad', 'missing', 'site'))
+  for site in ranked[:args.top] if args.top else ranked:
+    print('%12d %6.2f%% %12d %12d %12d  %s (dst %s)' %
+          (site.counts['exec'], 100.0 * site.counts['exec'] / total,
+           site.counts['slow'], site.counts['bad'], site.counts['missing'],
+           site.location(), site.dst))
+  never = sum(1 for site in ranked if site.counts['exec'] == 0)
+  print('%d sites, %d never executed' % (len(ranked), never))
+
+
+if __name__ == '__main__':
+  main()
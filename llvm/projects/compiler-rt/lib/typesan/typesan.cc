@@ -8,9 +8,13 @@
 #include "sanitizer_common/sanitizer_common.h"
 #include "sanitizer_common/sanitizer_flags.h"
 #include "sanitizer_common/sanitizer_libc.h"
+#include "sanitizer_common/sanitizer_atomic.h"
+#include "sanitizer_common/sanitizer_mutex.h"
 
 #include <cxxabi.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <csignal>
 #include <signal.h>
 #include <ucontext.h>
@@ -19,111 +23,189 @@
 #include <unordered_map>
 
 #include "metalloc/metapagetable_core.h"
+#include "typesan_flags.h"
+#include "typesan_profile.h"
+#include "typesan_report.h"
 
 using namespace __ubsan;
+using namespace __typesan;
 using namespace std;
 
 #define SAFECAST 0
 #define BADCAST 1
 
-//#define LOG_CAST_COUNT
-#define DO_REPORT_BADCAST
-#define DO_REPORT_BADCAST_FATAL
-#define DO_REPORT_BADCAST_FATAL_NOCOREDUMP
-//#define DO_REPORT_MISSING
-
-#ifdef DO_REPORT_BADCAST_FATAL_NOCOREDUMP
-#define TERMINATE exit(-1);
-#else
-#define TERMINATE abort();
-#endif
+// Queued reports are written out before the process goes down
+static void halt_process() {
+    flush_reports();
+    if (flags()->abort_on_error) {
+        abort();
+    }
+    exit(-1);
+}
 
-#define UNW_LOCAL_ONLY
-#include <cxxabi.h>
-#include <libunwind.h>
-#include <cstdio>
-#include <cstdlib>
-
-static void backtrace() {
-  unw_cursor_t cursor;
-  unw_context_t context;
-
-  // Initialize cursor to current frame for local unwinding.
-  unw_getcontext(&context);
-  unw_init_local(&cursor, &context);
-
-  // Unwind frames one by one, going up the frame stack.
-  while (unw_step(&cursor) > 0) {
-    unw_word_t offset, pc;
-    unw_get_reg(&cursor, UNW_REG_IP, &pc);
-    if (pc == 0) {
-      break;
+// Slow path of every failed check, kept out of line
+static NOINLINE void fail_cast(report_kind kind, uptr src_addr, uptr dst_addr, u64 src, u64 dst, sptr offset, uptr type_info) {
+    METALLOC_PROBE4(cast__bad, kind, src_addr, src, dst);
+    if (flags()->report_bad_casts) {
+        report_cast(kind, src_addr, dst_addr, src, dst, offset, type_info);
     }
-    std::printf("0x%lx:", pc);
-
-    char sym[256];
-    if (unw_get_proc_name(&cursor, sym, sizeof(sym), &offset) == 0) {
-      char* nameptr = sym;
-      int status;
-      char* demangled = abi::__cxa_demangle(sym, nullptr, nullptr, &status);
-      if (status == 0) {
-        nameptr = demangled;
-      }
-      std::printf(" (%s+0x%lx)\n", nameptr, offset);
-      std::free(demangled);
-    } else {
-      std::printf(" -- error: unable to obtain symbol name for this frame\n");
+    if (flags()->halt_on_error) {
+        halt_process();
     }
-  }
 }
 
+// Check counts of print_stats
+static volatile unsigned long cast_counts[CAST_BAD + 1];
+static volatile unsigned long blacklisted_casts;
+__attribute__ ((visibility ("default"))) long __typesan_alloc_count; /* enable TRACK_ALLOCATIONS in llvm/lib/Transforms/Utils/TypeSanUtil.cpp */
 
-static FILE *op = nullptr;
-
-static void write_log(string result) {
-        if (op == nullptr) {
-            op = fopen("cast_results.txt", "a");
-        }
-	fprintf(op, "%s\n", result.c_str());
-	fflush(op);
+static unsigned read_cast_counts(u64 *values) {
+    u64 total = 0;
+    for (unsigned i = 0; i <= CAST_BAD; ++i) {
+        total += cast_counts[i];
+    }
+    u64 nonNull = total - cast_counts[CAST_NULL];
+    // Blacklisted objects have metadata but are checked as missing
+    u64 withMetadata = nonNull - cast_counts[CAST_MISSING] + blacklisted_casts;
+    u64 counters[7] = { total, nonNull, withMetadata, cast_counts[CAST_EXACT],
+        cast_counts[CAST_BAD], blacklisted_casts, (u64)__typesan_alloc_count };
+    internal_memcpy(values, counters, sizeof(counters));
+    return 7;
 }
 
-#ifdef LOG_CAST_COUNT
-static volatile unsigned long type1 = 0;
-static volatile unsigned long type2 = 0;
-static volatile unsigned long type3 = 0;
-static volatile unsigned long type4 = 0;
-static volatile unsigned long type5 = 0;
-static volatile unsigned long type6 = 0;
-__attribute__ ((visibility ("default"))) long __typesan_alloc_count; /* enable TRACK_ALLOCATIONS in llvm/lib/Transforms/Utils/HexTypeUtil.cpp */
-
+// The writer thread reads and writes the counters; the handler must not
+// touch the interrupted thread's report ring
 static void write_log_casts(int signum) {
-    char outputStr[2048];
-    sprintf(outputStr, "%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu",
-        type1, type2, type3, type4, type5, type6, __typesan_alloc_count);
-    write_log(outputStr);
+    request_stats();
+}
+
+static void write_log_casts_at_exit() {
+    request_stats();
+    flush_reports();
 }
 
-struct LoggerType {
-    LoggerType() {
+static void typesan_init() {
+    InitializeFlags();
+    if (flags()->print_stats) {
         struct sigaction sa = {};
-	sa.sa_handler = write_log_casts;
-        sigaction(50, &sa, NULL);        
+        sa.sa_handler = write_log_casts;
+        sigaction(50, &sa, NULL);
+        atexit(write_log_casts_at_exit);
     }
-    ~LoggerType() {
-        write_log_casts(-1);
+}
+
+// The writer thread is started once the process can create threads
+__attribute__((constructor)) static void typesan_start_stats() {
+    if (flags()->print_stats) {
+        set_stats_source(read_cast_counts);
     }
+}
+
+#if SANITIZER_CAN_USE_PREINIT_ARRAY
+__attribute__((section(".preinit_array"), used))
+void (*__local_typesan_preinit)(void) = typesan_init;
+#else
+// Use a dynamic initializer.
+class TypesanInitializer {
+ public:
+  TypesanInitializer() {
+    typesan_init();
+  }
 };
-static LoggerType logger;
-#endif
+static TypesanInitializer typesan_initializer;
+#endif  // SANITIZER_CAN_USE_PREINIT_ARRAY
 
 typedef vector<uint64_t> parentHashSetTy;
+typedef unordered_map<uint64_t, const parentHashSetTy*> hashToSetMapTy;
 // Mapping from class-hash to pointer into parent-hashes set
-// Guaranteed to be fixed in size and the number of hashes is limited to the number of classes
-static unordered_map<uint64_t, parentHashSetTy*> *hashToSetMap;
+// Checks read it without locking, so it is copy-on-write: updates build a new
+// map under cinfoLock and publish it, and neither a published map nor its
+// parent sets change afterwards. Checks may still be using a superseded map,
+// so those are never freed; there is one per update, i.e. per DSO at most.
+static hashToSetMapTy *hashToSetMap;
 
 const static int pageSize = 4096;
 
+// Map being built by an update, along with the parent sets it created; the
+// others are shared with the published map and copied before changing
+struct cinfoUpdate {
+        hashToSetMapTy *map;
+        set<const parentHashSetTy*> fresh;
+};
+
+// Merge one class entry ([count, classHash, parentHashes...]) into the
+// parent-set map and return the entry that follows it
+static unsigned long *update_cinfo_entry(cinfoUpdate &update, unsigned long *entry) {
+        unsigned int pos = 0;
+        unsigned long hashCount = entry[pos++];
+        uint64_t classHash = entry[pos++];
+        // Upmost bit of count signals needs for merger
+        bool doMerge = (hashCount & (1 << 31)) != 0;
+        hashCount &= ~(1 << 31);
+
+        // See if class already has index associated or not
+        auto mapEntry = update.map->find(classHash);
+        bool alreadyProcessed = mapEntry != update.map->end();
+
+        // No merging requested and class already seen
+        // Skip to next class
+        if (!doMerge && alreadyProcessed) {
+            return entry + pos + hashCount - 1;
+        }
+
+        // Read and insert hashes for the selected class
+        // Class never processed yet, so include all entries
+        if (!alreadyProcessed) {
+            parentHashSetTy *parentSet = new parentHashSetTy();
+            parentSet->reserve(hashCount - 1);
+            for(unsigned int i = 0; i < hashCount - 1; i++) {
+                parentSet->push_back(entry[pos++]);
+            }
+            update.map->insert(make_pair(classHash, parentSet));
+            update.fresh.insert(parentSet);
+        // Class already processed, but merging requested
+        // Merge new elements uniquely using a set proxy
+        } else {
+            parentHashSetTy *parentSet = const_cast<parentHashSetTy*>(mapEntry->second);
+            if (update.fresh.count(parentSet) == 0) {
+                parentSet = new parentHashSetTy(*parentSet);
+                mapEntry->second = parentSet;
+                update.fresh.insert(parentSet);
+            }
+            set<uint64_t> hashSet(parentSet->begin(), parentSet->end());
+            for(unsigned int i = 0; i < hashCount - 1; i++) {
+                uint64_t hash = entry[pos++];
+                auto insertIt = hashSet.insert(hash);
+                if (insertIt.second) {
+                    parentSet->push_back(hash);
+                }
+            }
+        }
+        return entry + pos;
+}
+
+// Tables of loaded DSOs that were not merged into the map yet, as the
+// bounds of their typesan_cinfo sections. Their entries are
+// COMDAT-deduplicated by the linker, and merging waits for the first check
+// that needs the class hierarchy. A DSO's destructor drops its table if it
+// is still pending when the DSO is unloaded.
+typedef vector<pair<unsigned long*, unsigned long*> > cinfoTableListTy;
+static cinfoTableListTy *pendingCinfoTables;
+static atomic_uint32_t cinfoPending;
+static StaticSpinMutex cinfoLock;
+
+// Start an update from a copy of the published map; called with cinfoLock
+// held. The map is created on first use, as global initializers interact
+// poorly with this code.
+static void begin_cinfo_update(cinfoUpdate &update) {
+        update.map = hashToSetMap != nullptr ? new hashToSetMapTy(*hashToSetMap) :
+            new hashToSetMapTy(1024);
+}
+
+static void publish_cinfo_update(cinfoUpdate &update) {
+        __atomic_store_n(&hashToSetMap, update.map, __ATOMIC_RELEASE);
+}
+
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
 void __update_cinfo(unsigned int classCount, unsigned long *infoArray) {
 
@@ -137,127 +219,111 @@ void __update_cinfo(unsigned int classCount, unsigned long *infoArray) {
 	  write_flog(print);
 	#endif
 
-        // init STL data structures (global initializer interacts poorly with this code)
-        if (hashToSetMap == nullptr) {
-            hashToSetMap = new unordered_map<uint64_t, parentHashSetTy*>(1024);
+        METALLOC_PROBE2(cinfo__update, classCount, infoArray);
+        SpinMutexLock lock(&cinfoLock);
+        cinfoUpdate update;
+        begin_cinfo_update(update);
+        for (unsigned int processedCount = 0; processedCount < classCount; processedCount++) {
+            infoArray = update_cinfo_entry(update, infoArray);
         }
-        
-        unsigned int processedCount = 0;
-        unsigned int pos = 0;
-        while(processedCount < classCount) {
-            unsigned long hashCount = infoArray[pos++];
-            uint64_t classHash = infoArray[pos++];
-            // Upmost bit of count signals needs for merger
-            bool doMerge = (hashCount & (1 << 31)) != 0;
-            hashCount &= ~(1 << 31);
-
-            // See if class already has index associated or not
-            auto mapEntry = hashToSetMap->find(classHash);
-            bool alreadyProcessed = false;
-            parentHashSetTy* parentSet;
-            if (mapEntry != hashToSetMap->end()) {
-                alreadyProcessed = true;
-                parentSet = mapEntry->second;
-            } else {
-                parentSet = new parentHashSetTy();
-                hashToSetMap->insert(make_pair(classHash, parentSet));
-            }
-            
-            // No merging requested and class already seen
-            // Skip to next class
-            if (!doMerge && alreadyProcessed) {
-                pos += hashCount - 1;
-                processedCount++;
-                continue;
+        publish_cinfo_update(update);
+}
+
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __register_cinfo_table(unsigned long *start, unsigned long *stop) {
+        if (start == stop) {
+            return;
+        }
+        SpinMutexLock lock(&cinfoLock);
+        if (pendingCinfoTables == nullptr) {
+            pendingCinfoTables = new cinfoTableListTy();
+        }
+        pendingCinfoTables->push_back(make_pair(start, stop));
+        atomic_store(&cinfoPending, 1, memory_order_release);
+}
+
+// Called from the destructor of the DSO whose table this is. Objects whose
+// type information lived in the DSO cannot be checked once it is gone, so a
+// table that was never needed is dropped rather than merged.
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __unregister_cinfo_table(unsigned long *start, unsigned long *stop) {
+        SpinMutexLock lock(&cinfoLock);
+        if (pendingCinfoTables == nullptr) {
+            return;
+        }
+        for (auto it = pendingCinfoTables->begin(); it != pendingCinfoTables->end(); ++it) {
+            if (it->first == start) {
+                pendingCinfoTables->erase(it);
+                break;
             }
-            
-            // Read and insert hashes for the selected class
-            // Class never processed yet, so include all entries
-            if (!alreadyProcessed) {
-                parentSet->reserve(hashCount - 1);
-                for(unsigned int i = 0; i < hashCount - 1; i++) {
-                    parentSet->push_back(infoArray[pos++]);
-                }
-            // Class already processed, but merging requested
-            // Merge new elements uniquely using a set proxy
-            } else {
-                set<uint64_t> hashSet(parentSet->begin(), parentSet->end());
-                for(unsigned int i = 0; i < hashCount - 1; i++) {
-                    uint64_t hash = infoArray[pos++];
-                    auto insertIt = hashSet.insert(hash);
-                    if (insertIt.second) {
-                        parentSet->push_back(hash);
+        }
+}
+
+static void merge_pending_cinfo() {
+        SpinMutexLock lock(&cinfoLock);
+        if (hashToSetMap == nullptr || (pendingCinfoTables != nullptr && !pendingCinfoTables->empty())) {
+            cinfoUpdate update;
+            begin_cinfo_update(update);
+            if (pendingCinfoTables != nullptr) {
+                METALLOC_PROBE1(cinfo__merge, pendingCinfoTables->size());
+                for (auto &table : *pendingCinfoTables) {
+                    for (unsigned long *entry = table.first; entry < table.second; ) {
+                        entry = update_cinfo_entry(update, entry);
                     }
                 }
+                pendingCinfoTables->clear();
             }
-            
-            processedCount++;
+            publish_cinfo_update(update);
         }
+        atomic_store(&cinfoPending, 0, memory_order_release);
 }
 
-__attribute__((always_inline)) inline static void check_cast(uptr* src_addr, uptr* dst_addr, uint64_t dst) {
-#ifdef LOG_CAST_COUNT
-    type1++;
-#endif
-
+__attribute__((always_inline)) inline static cast_outcome check_cast_impl(uptr* src_addr, uptr* dst_addr, uint64_t dst) {
         if (src_addr == nullptr)
-            return;
-
-#ifdef LOG_CAST_COUNT
-    type2++;
-#endif 
+            return CAST_NULL;
 
 	uint64_t src = 0;
 
         unsigned long ptrInt = (unsigned long)src_addr;
         unsigned long pageIndex = (unsigned long)ptrInt / pageSize;
         unsigned long pageEntry = pageTable[pageIndex];
-        unsigned long *metaBase = (unsigned long*)(pageEntry >> 8);
-        unsigned long alignment = pageEntry & 0xFF;
-        char *alloc_base = (char*)(metaBase[2 * ((ptrInt & (pageSize - 1)) >> alignment)]);
+        unsigned long *metaBase = (unsigned long*)metapagetable_entry_base(pageEntry);
+        unsigned long metaIndex = metapagetable_entry_index(pageEntry, ptrInt);
+        // Pages without an entry, such as data of uninstrumented objects or
+        // of unloaded DSOs, have no metadata either
+        char *alloc_base = pageEntry != 0 ? (char*)(metaBase[2 * metaIndex]) : nullptr;
         // No metadata for object
         if (alloc_base == nullptr) {
-#ifdef DO_REPORT_MISSING
-		static int missingc = 0;
-		static int missingt = 1;
-		missingc++;
-		if (missingc >= missingt) {
-			printf("\n\t\t== Missing metadata ==\n");
-			printf("src_addr=%p dst_addr=%p dst=%lu\n", src_addr, dst_addr, (unsigned long) dst);
-			backtrace();
-			missingt *= 2;
+		METALLOC_PROBE2(cast__missing, src_addr, dst);
+		if (UNLIKELY(flags()->report_missing_metadata)) {
+			static int missingc = 0;
+			static int missingt = 1;
+			missingc++;
+			if (missingc >= missingt) {
+				report_cast(REPORT_MISSING_METADATA, (uptr)src_addr, (uptr)dst_addr, 0, dst, 0, 0);
+				missingt *= 2;
+			}
 		}
-#endif
-		return;
+		return CAST_MISSING;
 	}
-        
-#ifdef LOG_CAST_COUNT
-    type3++;
-#endif
 
         long offset = (char*)dst_addr - alloc_base;
         if (offset < 0) {
-#ifdef DO_REPORT_BADCAST
-            printf("\n\t\t== TypeSan Bad-casting Reports ==\n");
-            printf("\t\tDetected type confusion from negative offset (%ld) to %lu\n", offset, (unsigned long) dst);
-            backtrace();
-#endif
-#ifdef DO_REPORT_BADCAST_FATAL
-            TERMINATE
-#endif
-	    return;
+            fail_cast(REPORT_NEGATIVE_OFFSET, (uptr)src_addr, (uptr)dst_addr, 0, dst, offset, 0);
+	    return CAST_BAD;
         }
-        unsigned long *typeInfo = (unsigned long*)(metaBase[2 * ((ptrInt & (pageSize - 1)) >> alignment) + 1]);
+        unsigned long *typeInfo = (unsigned long*)(metaBase[2 * metaIndex + 1]);
+        profile_cast_source((uptr)alloc_base, (const u64*)typeInfo);
         long currentOffset = typeInfo[0];
         // If first offset is not 0, then we are pointing to size field
         // This suggests an array allocation and we need to adjust offset to match
         if (currentOffset != 0) {
             if (currentOffset == -1) {
 		// special case: no typeinfo at all means blacklisted
-#ifdef LOG_CAST_COUNT
-		type6++;
-#endif
-                return;
+		if (UNLIKELY(flags()->print_stats)) {
+		    blacklisted_casts++;
+		}
+                return CAST_MISSING;
             }
             offset %= currentOffset;
             currentOffset = 0;
@@ -292,43 +358,29 @@ __attribute__((always_inline)) inline static void check_cast(uptr* src_addr, upt
             }
         }
         if (src == 0) {
-#ifdef DO_REPORT_BADCAST
-            //SourceLocation Loc = Data->Loc.acquire();
-            printf("\n\t\t== TypeSan Bad-casting Reports ==\n");
-            //printf("\t\tFileName : %s Line: %d Column %d\n", Loc.getFilename(), Loc.getLine(), Loc.getColumn());
-            printf("\t\tDetected type confusion from unknown offset (%ld) in type-info (%p) to %lu\n", (char*)dst_addr - alloc_base, (unsigned long*)(metaBase[2 * ((ptrInt & (pageSize - 1)) >> alignment) + 1]), (unsigned long) dst);
-            backtrace();
-#endif
-#ifdef DO_REPORT_BADCAST_FATAL
-            TERMINATE
-#endif
-	    return;
+            fail_cast(REPORT_UNKNOWN_OFFSET, (uptr)src_addr, (uptr)dst_addr, 0, dst,
+                (char*)dst_addr - alloc_base, metaBase[2 * metaIndex + 1]);
+	    return CAST_BAD;
         }
             
         // Types match perfectly
         if(src == dst) {
-
-#ifdef LOG_CAST_COUNT
-    type4++;
-#endif
-
-            return;
+            return CAST_EXACT;
         }
         
 	int result = -1;
     
 	{
-                auto indexIt = hashToSetMap->find(src);
-                if (indexIt == hashToSetMap->end()) {
-#ifdef DO_REPORT_BADCAST
-                    printf("\n\t\t== TypeSan Bad-casting Reports ==\n");
-                    printf("\t\tDetected type confusion from unknown hash (%lu) to %lu\n", (unsigned long) src, (unsigned long) dst);
-                    backtrace();
-#endif
-#ifdef DO_REPORT_BADCAST_FATAL
-                    TERMINATE
-#endif
-		    return;
+                hashToSetMapTy *map = __atomic_load_n(&hashToSetMap, __ATOMIC_ACQUIRE);
+                if (UNLIKELY(atomic_load(&cinfoPending, memory_order_acquire) || map == nullptr)) {
+                    merge_pending_cinfo();
+                    map = __atomic_load_n(&hashToSetMap, __ATOMIC_ACQUIRE);
+                }
+                METALLOC_PROBE3(cast__slow, src_addr, src, dst);
+                auto indexIt = map->find(src);
+                if (indexIt == map->end()) {
+                    fail_cast(REPORT_UNKNOWN_HASH, (uptr)src_addr, (uptr)dst_addr, src, dst, 0, 0);
+		    return CAST_BAD;
                 }
 
                 auto *parentHashSet = indexIt->second;
@@ -345,36 +397,160 @@ __attribute__((always_inline)) inline static void check_cast(uptr* src_addr, upt
                 }
 	}
 
-#ifdef LOG_CAST_COUNT
-        if (result == BADCAST) {
-            type5++;
-        }
-#endif
-
 	if (result == BADCAST) {
-#ifdef DO_REPORT_BADCAST
-		printf("\n\t\t== TypeSan Bad-casting Reports ==\n");
-		printf("\t\tDetected type confusion from %lu to %lu\n", (unsigned long) src, (unsigned long) dst);
-		backtrace();
-#endif
-#ifdef DO_REPORT_BADCAST_FATAL
-		TERMINATE
-#endif
-		return;
+		fail_cast(REPORT_BAD_CAST, (uptr)src_addr, (uptr)dst_addr, src, dst, 0, 0);
+		return CAST_BAD;
 	}
 
-	return;
+	return CAST_SLOW;
+}
+
+__attribute__((always_inline)) inline static cast_outcome check_cast(uptr* src_addr, uptr* dst_addr, uint64_t dst) {
+        cast_outcome outcome = check_cast_impl(src_addr, dst_addr, dst);
+        if (UNLIKELY(flags()->print_stats)) {
+            cast_counts[outcome]++;
+        }
+        return outcome;
 }
 
 // Checking bad-casting 
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __changing_type_casting_verification_site(uptr* src_addr, uptr* dst_addr, uint64_t dst, cast_site *site) {
+    profile_cast(site, check_cast(src_addr, dst_addr, dst));
+}
+
+// Checking bad-casting 
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __type_casting_verification_site(uptr* src_addr, uint64_t dst, cast_site *site) {
+    profile_cast(site, check_cast(src_addr, src_addr, dst));
+}
+
+// Entry points of objects compiled before checks carried their site
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
 void __changing_type_casting_verification(uptr* src_addr, uptr* dst_addr, uint64_t dst) {
     check_cast(src_addr, dst_addr, dst);
 }
 
-// Checking bad-casting 
 extern "C" SANITIZER_INTERFACE_ATTRIBUTE
 void __type_casting_verification(uptr* src_addr, uint64_t dst) {
     check_cast(src_addr, src_addr, dst);
 }
 
+
+// Object registration for custom allocators. Arenas and pools hand out
+// memory that TypeSan does not see being allocated, so objects created in it
+// are described explicitly, either by the compiler for placement new or by
+// the allocator through the public interface in sanitizer/typesan_interface.h.
+
+// Write (base, typeinfo) into the metadata of every granule of [ptr, ptr + size).
+// Pages without fine-grained granule entries are left alone, since one of
+// their entries describes more than the object.
+static void set_range_metadata(unsigned long ptr, unsigned long size, unsigned long base, unsigned long typeInfo) {
+        unsigned long end = ptr + size;
+        while (ptr < end) {
+            unsigned long pageEnd = (ptr | (METALLOC_PAGESIZE - 1)) + 1;
+            unsigned long chunkEnd = pageEnd < end ? pageEnd : end;
+            unsigned long pageEntry = pageTable[ptr / pageSize];
+            unsigned long alignment = pageEntry & 0xFF;
+            if (pageEntry != 0 && !(pageEntry & METALLOC_OBJECTFLAG) && alignment <= METALLOC_PAGESHIFT) {
+                unsigned long *metadata = (unsigned long*)metapagetable_entry_base(pageEntry) +
+                    2 * metapagetable_entry_index(pageEntry, ptr);
+                unsigned long count = metapagetable_entry_count(pageEntry, chunkEnd - ptr);
+                for (unsigned long i = 0; i < count; ++i) {
+                    metadata[2 * i] = base;
+                    metadata[2 * i + 1] = typeInfo;
+                }
+            }
+            ptr = chunkEnd;
+        }
+}
+
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __typesan_register_object(const void *ptr, unsigned long typeInfo, uptr count) {
+        unsigned long ptrInt = (unsigned long)ptr;
+        if (ptr == nullptr || typeInfo == 0 || count == 0) {
+            return;
+        }
+        unsigned long pageEntry = pageTable[ptrInt / pageSize];
+        if (pageEntry == 0) {
+            return;
+        }
+        // typeInfo points at the size field; single objects skip it, as for
+        // compiler-tracked allocations
+        unsigned long size = ((unsigned long*)typeInfo)[0] * count;
+        if (pageEntry & METALLOC_OBJECTFLAG) {
+            // Object entries have one metadata entry per heap chunk, so only a
+            // single object at the start of its chunk can be described
+            unsigned long objectOffset = (ptrInt & (METALLOC_PAGESIZE - 1)) +
+                ((pageEntry >> METALLOC_OBJECTPHASESHIFT) & METALLOC_OBJECTPHASEMASK);
+            unsigned long reciprocal = metalloc_object_reciprocals[pageEntry & (METALLOC_OBJECTCLASSES - 1)];
+            unsigned long index = (objectOffset * reciprocal) >> METALLOC_OBJECTRECIPROCALSHIFT;
+            if (count != 1 || size == 0 ||
+                (objectOffset != 0 && (((objectOffset - 1) * reciprocal) >> METALLOC_OBJECTRECIPROCALSHIFT) == index) ||
+                (((objectOffset + size - 1) * reciprocal) >> METALLOC_OBJECTRECIPROCALSHIFT) != index) {
+                return;
+            }
+            unsigned long *metadata = (unsigned long*)metapagetable_entry_base(pageEntry) + 2 * index;
+            metadata[0] = ptrInt;
+            metadata[1] = typeInfo + sizeof(unsigned long);
+            return;
+        }
+        unsigned long granule = (unsigned long)1 << (pageEntry & 0xFF);
+        // Objects sharing a granule with their neighbours cannot be described
+        // without misattributing part of it
+        if ((pageEntry & 0xFF) > METALLOC_PAGESHIFT || (ptrInt & (granule - 1)) != 0 || (size & (granule - 1)) != 0) {
+            return;
+        }
+        set_range_metadata(ptrInt, size, ptrInt, count == 1 ? typeInfo + sizeof(unsigned long) : typeInfo);
+}
+
+// Arena ranges given their own metadata by __typesan_register_range, along
+// with the page-table entries they replaced
+struct typesanRange {
+        unsigned long size;
+        vector<unsigned long> savedEntries;
+};
+static unordered_map<unsigned long, typesanRange> *registeredRanges;
+static StaticSpinMutex rangesLock;
+
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __typesan_register_range(const void *ptr, uptr size) {
+        unsigned long start = RoundUpTo((unsigned long)ptr, METALLOC_PAGESIZE);
+        unsigned long end = RoundDownTo((unsigned long)ptr + size, METALLOC_PAGESIZE);
+        if (end <= start) {
+            return;
+        }
+        SpinMutexLock lock(&rangesLock);
+        if (registeredRanges == nullptr) {
+            registeredRanges = new unordered_map<unsigned long, typesanRange>();
+        }
+        if (registeredRanges->count(start)) {
+            return;
+        }
+        typesanRange &range = (*registeredRanges)[start];
+        range.size = end - start;
+        range.savedEntries.assign(&pageTable[start / pageSize], &pageTable[end / pageSize]);
+        void *metadata = allocate_metadata(range.size, METALLOC_FIXEDSHIFT);
+        set_metapagetable_entries((void*)start, range.size, metadata, METALLOC_FIXEDSHIFT);
+}
+
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __typesan_unregister_range(const void *ptr, uptr size) {
+        unsigned long start = RoundUpTo((unsigned long)ptr, METALLOC_PAGESIZE);
+        {
+            SpinMutexLock lock(&rangesLock);
+            if (registeredRanges != nullptr) {
+                auto rangeIt = registeredRanges->find(start);
+                if (rangeIt != registeredRanges->end()) {
+                    typesanRange &range = rangeIt->second;
+                    deallocate_metadata((void*)start, range.size, METALLOC_FIXEDSHIFT);
+                    internal_memcpy(&pageTable[start / pageSize], range.savedEntries.data(),
+                        range.savedEntries.size() * sizeof(unsigned long));
+                    registeredRanges->erase(rangeIt);
+                    return;
+                }
+            }
+        }
+        // Objects in memory that kept its allocator's metadata
+        set_range_metadata((unsigned long)ptr, size, 0, 0);
+}
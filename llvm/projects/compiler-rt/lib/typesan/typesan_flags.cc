@@ -0,0 +1,53 @@
+//===-- typesan_flags.cc --------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Runtime flags for TypeSan, read from TYPESAN_OPTIONS.
+//
+//===----------------------------------------------------------------------===//
+
+#include "typesan_flags.h"
+#include "sanitizer_common/sanitizer_common.h"
+#include "sanitizer_common/sanitizer_flags.h"
+#include "sanitizer_common/sanitizer_flag_parser.h"
+
+namespace __typesan {
+
+Flags typesan_flags;
+
+void Flags::SetDefaults() {
+#define TYPESAN_FLAG(Type, Name, DefaultValue, Description) Name = DefaultValue;
+#include "typesan_flags.inc"
+#undef TYPESAN_FLAG
+}
+
+void RegisterTypesanFlags(FlagParser *parser, Flags *f) {
+#define TYPESAN_FLAG(Type, Name, DefaultValue, Description) \
+  RegisterFlag(parser, #Name, Description, &f->Name);
+#include "typesan_flags.inc"
+#undef TYPESAN_FLAG
+}
+
+// The common flags belong to the UBSan runtime linked alongside, which
+// parses them from UBSAN_OPTIONS; only TypeSan's own flags are read here.
+void InitializeFlags() {
+  Flags *f = flags();
+  f->SetDefaults();
+
+  FlagParser parser;
+  RegisterTypesanFlags(&parser, f);
+
+  // Override from user-specified string.
+  if (&__typesan_default_options)
+    parser.ParseString(__typesan_default_options());
+  // Override from environment variable.
+  parser.ParseString(GetEnv("TYPESAN_OPTIONS"));
+  if (Verbosity()) ReportUnrecognizedFlags();
+}
+
+}  // namespace __typesan
@@ -0,0 +1,47 @@
+//===-- typesan_flags.h -----------------------------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Runtime flags for TypeSan, read from TYPESAN_OPTIONS.
+//
+//===----------------------------------------------------------------------===//
+#ifndef TYPESAN_FLAGS_H
+#define TYPESAN_FLAGS_H
+
+#include "sanitizer_common/sanitizer_internal_defs.h"
+
+namespace __sanitizer {
+class FlagParser;
+}
+
+namespace __typesan {
+
+struct Flags {
+#define TYPESAN_FLAG(Type, Name, DefaultValue, Description) Type Name;
+#include "typesan_flags.inc"
+#undef TYPESAN_FLAG
+
+  void SetDefaults();
+};
+
+extern Flags typesan_flags;
+inline Flags *flags() { return &typesan_flags; }
+
+void InitializeFlags();
+void RegisterTypesanFlags(__sanitizer::FlagParser *parser, Flags *f);
+
+}  // namespace __typesan
+
+extern "C" {
+// Users may provide their own implementation of __typesan_default_options to
+// override the default flag values.
+SANITIZER_INTERFACE_ATTRIBUTE SANITIZER_WEAK_ATTRIBUTE
+const char *__typesan_default_options();
+}  // extern "C"
+
+#endif  // TYPESAN_FLAGS_H
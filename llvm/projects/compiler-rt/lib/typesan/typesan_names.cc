@@ -0,0 +1,161 @@
+//===-- typesan_names.cc ----------------------------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Type names of TypeSan reports, see typesan_names.h.
+//
+//===----------------------------------------------------------------------===//
+
+#include "typesan_names.h"
+
+#include "sanitizer_common/sanitizer_common.h"
+#include "sanitizer_common/sanitizer_libc.h"
+#include "sanitizer_common/sanitizer_mutex.h"
+
+#include <cxxabi.h>
+#include <stdlib.h>
+
+namespace __typesan {
+
+// Layout of the records TypeSanTree emits into the typesan_names section.
+// Records are 8-byte aligned and the name is NUL-terminated.
+struct name_record {
+  u64 hash;
+  char name[1];
+};
+
+// A registered section. Those of DSOs unloaded after they were indexed
+// point at a copy, as the index refers to their names.
+struct name_section {
+  char *start;
+  char *stop;
+};
+
+struct name_entry {
+  u64 hash;
+  const char *name;
+};
+
+// All of the below are under sections_lock
+static InternalMmapVectorNoCtor<name_section> sections;
+static StaticSpinMutex sections_lock;
+// Sections registered so far that are already in the index
+static uptr indexed_sections;
+static InternalMmapVectorNoCtor<name_entry> index;
+
+static bool compare_entries(const name_entry &a, const name_entry &b) {
+  return a.hash < b.hash;
+}
+
+static void index_section(const name_section &section) {
+  char *pos = section.start;
+  while (pos + sizeof(u64) < section.stop) {
+    name_record *record = (name_record *)pos;
+    name_entry entry = {record->hash, record->name};
+    index.push_back(entry);
+    pos = (char *)RoundUpTo(
+        (uptr)record->name + internal_strlen(record->name) + 1, sizeof(u64));
+  }
+}
+
+static void update_index() {
+  if (indexed_sections == sections.size())
+    return;
+  if (index.capacity() == 0)
+    index.Initialize(1024);
+  for (; indexed_sections < sections.size(); ++indexed_sections)
+    index_section(sections[indexed_sections]);
+  InternalSort(&index, index.size(), compare_entries);
+}
+
+// Hashed names are the class's struct name, "trackedtype.", the mangled
+// typeinfo symbol and an optional ".N" suffix from type renaming.
+static void demangle_type(const char *name, char *buf, uptr size) {
+  const char kPrefix[] = "trackedtype._ZTI";
+  internal_strncpy(buf, name, size - 1);
+  buf[size - 1] = '\0';
+  if (internal_strncmp(name, kPrefix, sizeof(kPrefix) - 1) != 0)
+    return;
+  char mangled[1024];
+  internal_strncpy(mangled, name + sizeof(kPrefix) - 1, sizeof(mangled) - 1);
+  mangled[sizeof(mangled) - 1] = '\0';
+  if (char *suffix = internal_strchr(mangled, '.'))
+    *suffix = '\0';
+  int status;
+  char *result = abi::__cxa_demangle(mangled, nullptr, nullptr, &status);
+  if (status != 0)
+    return;
+  internal_strncpy(buf, result, size - 1);
+  free(result);
+}
+
+// The lock is held throughout, so that the DSO the name lives in cannot go
+// away under it
+bool type_name(u64 hash, char *buf, uptr size) {
+  if (hash == 0 || size == 0)
+    return false;
+  SpinMutexLock lock(&sections_lock);
+  update_index();
+  uptr begin = 0, end = index.size();
+  while (begin < end) {
+    uptr mid = begin + (end - begin) / 2;
+    if (index[mid].hash < hash)
+      begin = mid + 1;
+    else
+      end = mid;
+  }
+  if (begin == index.size() || index[begin].hash != hash)
+    return false;
+  demangle_type(index[begin].name, buf, size);
+  return true;
+}
+
+}  // namespace __typesan
+
+using namespace __typesan;
+
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __typesan_register_names(char *start, char *stop) {
+  if (start == stop)
+    return;
+  SpinMutexLock lock(&sections_lock);
+  if (sections.capacity() == 0)
+    sections.Initialize(16);
+  name_section section = {start, stop};
+  sections.push_back(section);
+}
+
+// Called from the destructor of the DSO the section belongs to. A section
+// that was never indexed is simply forgotten; otherwise the index keeps
+// pointing into it, so it is copied first.
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __typesan_unregister_names(char *start, char *stop) {
+  if (start == stop)
+    return;
+  SpinMutexLock lock(&sections_lock);
+  uptr i = 0;
+  while (i < sections.size() && sections[i].start != start)
+    ++i;
+  if (i == sections.size())
+    return;
+  if (i >= indexed_sections) {
+    for (; i + 1 < sections.size(); ++i)
+      sections[i] = sections[i + 1];
+    sections.pop_back();
+    return;
+  }
+  uptr size = stop - start;
+  char *copy = (char *)MmapOrDie(size, "typesan names");
+  internal_memcpy(copy, start, size);
+  for (uptr j = 0; j < index.size(); ++j) {
+    if (index[j].name >= start && index[j].name < stop)
+      index[j].name = copy + (index[j].name - start);
+  }
+  sections[i].start = copy;
+  sections[i].stop = copy + size;
+}
@@ -0,0 +1,39 @@
+//===-- typesan_names.h -----------------------------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Type names of TypeSan reports. Every DSO carries the names of its class
+// hashes in the typesan_names section; the runtime only records where the
+// sections are and indexes them when the first report needs a name. A DSO
+// unloaded after that leaves a copy of its section behind.
+//
+//===----------------------------------------------------------------------===//
+#ifndef TYPESAN_NAMES_H
+#define TYPESAN_NAMES_H
+
+#include "sanitizer_common/sanitizer_internal_defs.h"
+
+namespace __typesan {
+
+using namespace __sanitizer;
+
+// Copy the demangled name of the class with the given hash into buf,
+// truncated to size. Returns false if no loaded DSO knows it. Slow on first
+// use; meant for the report writer.
+bool type_name(u64 hash, char *buf, uptr size);
+
+}  // namespace __typesan
+
+extern "C" {
+SANITIZER_INTERFACE_ATTRIBUTE
+void __typesan_register_names(char *start, char *stop);
+SANITIZER_INTERFACE_ATTRIBUTE
+void __typesan_unregister_names(char *start, char *stop);
+}  // extern "C"
+
+#endif  // TYPESAN_NAMES_H
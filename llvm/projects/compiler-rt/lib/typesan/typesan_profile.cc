@@ -0,0 +1,539 @@
+//===-- typesan_profile.cc --------------------------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Per-cast-site profile of TypeSan, see typesan_profile.h. With the
+// profile_path=<path> flag the profile is written to <path>.<pid> at exit and
+// whenever __typesan_dump_profile() is called, one tab-separated line per
+// site; scripts/typesan_profile.py merges and ranks them. Allocation sites
+// and the casts made on their objects go to <path>.<pid>.allocs, from which
+// scripts/typesan_blacklist.py derives a blacklist.
+//
+//===----------------------------------------------------------------------===//
+
+#include "typesan_profile.h"
+#include "typesan_flags.h"
+
+#include "sanitizer_common/sanitizer_atomic.h"
+#include "sanitizer_common/sanitizer_common.h"
+#include "sanitizer_common/sanitizer_libc.h"
+#include "sanitizer_common/sanitizer_mutex.h"
+#include "sanitizer_common/sanitizer_posix.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace __typesan {
+
+const unsigned kOutcomeCount = CAST_BAD + 1;
+const uptr kSiteChunkSize = 4096;
+const uptr kMaxSiteChunks = 256;
+
+bool profile_enabled;
+
+// What the profile needs of a site, copied out of its record so that the
+// profile outlives dlclose of the DSO.
+struct site_info {
+  u64 key;
+  u64 dst;
+  char *file;
+  u32 line;
+  u32 column;
+};
+
+struct alloc_site_info {
+  u64 type_hash;
+  char *type;
+  char *function;
+  char *name;
+};
+
+// Id 0 is never assigned, records start out with it
+static InternalMmapVectorNoCtor<site_info> sites;
+static StaticSpinMutex sites_lock;
+
+// Allocation sites are looked up on every profiled cast, so they live in
+// chunks that never move: entries are filled in under sites_lock before
+// alloc_site_count covers them, and read without the lock.
+static atomic_uintptr_t alloc_site_chunks[kMaxSiteChunks];
+static atomic_uint32_t alloc_site_count;
+
+static const alloc_site_info *get_alloc_site(u32 id) {
+  if (id >= atomic_load(&alloc_site_count, memory_order_acquire))
+    return nullptr;
+  alloc_site_info *chunk = (alloc_site_info *)atomic_load(
+      &alloc_site_chunks[id / kSiteChunkSize], memory_order_relaxed);
+  return &chunk[id % kSiteChunkSize];
+}
+
+static bool alloc_sites_full() {
+  return atomic_load(&alloc_site_count, memory_order_relaxed) >=
+         kMaxSiteChunks * kSiteChunkSize;
+}
+
+// Called with sites_lock held, while the table is not full
+static u32 add_alloc_site(const alloc_site_info &info) {
+  u32 id = atomic_load(&alloc_site_count, memory_order_relaxed);
+  uptr chunk_index = id / kSiteChunkSize;
+  alloc_site_info *chunk = (alloc_site_info *)atomic_load(
+      &alloc_site_chunks[chunk_index], memory_order_relaxed);
+  if (chunk == nullptr) {
+    chunk = (alloc_site_info *)MmapOrDie(kSiteChunkSize * sizeof(alloc_site_info),
+                                         "typesan alloc sites");
+    atomic_store(&alloc_site_chunks[chunk_index], (uptr)chunk,
+                 memory_order_relaxed);
+  }
+  chunk[id % kSiteChunkSize] = info;
+  atomic_store(&alloc_site_count, id + 1, memory_order_release);
+  return id;
+}
+static atomic_uint32_t profile_initialized;
+
+struct site_counters {
+  u64 counts[kOutcomeCount];
+};
+
+struct alloc_site_counters {
+  u64 allocs;
+  u64 bytes;
+  u64 casts;
+};
+
+// Counters of one thread, in chunks mapped on first use. Only the owning
+// thread writes them; dumps read them racily. When a thread exits, its
+// counts are folded into retired_profile and the block, chunks included, is
+// handed to the next new thread. Blocks stay on thread_profiles for good.
+struct thread_profile {
+  atomic_uintptr_t chunks[kMaxSiteChunks];
+  atomic_uintptr_t alloc_chunks[kMaxSiteChunks];
+  thread_profile *next;
+  thread_profile *free_next;
+};
+
+// Casts per allocated type, keyed by type hash with open addressing.
+// Casts on objects whose allocation site is not known are counted as
+// unattributed, and types that do not fit are only counted as overflow;
+// both keep the blacklist generator from trusting the type.
+const uptr kTypeTableSize = 1 << 16;
+const uptr kTypeTableProbes = 64;
+
+struct type_entry {
+  atomic_uint64_t hash;
+  atomic_uint64_t casts;
+  atomic_uint64_t unattributed;
+};
+
+static type_entry *type_table;
+static atomic_uint64_t type_table_overflow;
+
+// Allocation site of the object last allocated at each base address, as
+// (base << kOwnerIdBits) | id, direct-mapped by base. Later objects evict
+// earlier ones, whose casts then become unattributed.
+const unsigned kOwnerTableBits = 20;
+const uptr kOwnerTableSize = 1 << kOwnerTableBits;
+const unsigned kOwnerIdBits = 17;
+
+static atomic_uint64_t *owner_table;
+
+static THREADLOCAL thread_profile *thread_counters;
+static atomic_uintptr_t thread_profiles;
+// Counts of exited threads and their blocks, under sites_lock
+static thread_profile *retired_profile;
+static thread_profile *free_profiles;
+static pthread_key_t profile_key;
+
+static thread_profile *new_profile() {
+  thread_profile *profile =
+      (thread_profile *)MmapOrDie(sizeof(thread_profile), "typesan profile");
+  uptr head = atomic_load(&thread_profiles, memory_order_relaxed);
+  do {
+    profile->next = (thread_profile *)head;
+  } while (!atomic_compare_exchange_weak(&thread_profiles, &head, (uptr)profile,
+                                         memory_order_release));
+  return profile;
+}
+
+static uptr counter_chunk(atomic_uintptr_t *chunks, uptr chunk_index,
+                          uptr counter_size) {
+  uptr chunk = atomic_load(&chunks[chunk_index], memory_order_relaxed);
+  if (UNLIKELY(chunk == 0)) {
+    chunk = (uptr)MmapOrDie(kSiteChunkSize * counter_size,
+                            "typesan profile chunk");
+    atomic_store(&chunks[chunk_index], chunk, memory_order_release);
+  }
+  return chunk;
+}
+
+// Add the counters in the chunks of from to those of to and clear them;
+// both are arrays of u64 counters
+static void fold_chunks(atomic_uintptr_t *to, atomic_uintptr_t *from,
+                        uptr counter_size) {
+  for (uptr i = 0; i < kMaxSiteChunks; ++i) {
+    u64 *source = (u64 *)atomic_load(&from[i], memory_order_relaxed);
+    if (source == nullptr)
+      continue;
+    u64 *target = (u64 *)counter_chunk(to, i, counter_size);
+    uptr count = kSiteChunkSize * counter_size / sizeof(u64);
+    for (uptr j = 0; j < count; ++j)
+      target[j] += source[j];
+    internal_memset(source, 0, kSiteChunkSize * counter_size);
+  }
+}
+
+// Thread exit
+static void release_thread_profile(void *arg) {
+  thread_profile *profile = (thread_profile *)arg;
+  thread_counters = nullptr;
+  SpinMutexLock lock(&sites_lock);
+  fold_chunks(retired_profile->chunks, profile->chunks, sizeof(site_counters));
+  fold_chunks(retired_profile->alloc_chunks, profile->alloc_chunks,
+              sizeof(alloc_site_counters));
+  profile->free_next = free_profiles;
+  free_profiles = profile;
+}
+
+static thread_profile *get_thread_profile() {
+  if (thread_counters != nullptr)
+    return thread_counters;
+  thread_profile *profile;
+  {
+    SpinMutexLock lock(&sites_lock);
+    profile = free_profiles;
+    if (profile != nullptr)
+      free_profiles = profile->free_next;
+  }
+  if (profile == nullptr)
+    profile = new_profile();
+  pthread_setspecific(profile_key, profile);
+  thread_counters = profile;
+  return profile;
+}
+
+static void dump_at_exit() {
+  __typesan_dump_profile();
+}
+
+static void init_profile() {
+  if (atomic_exchange(&profile_initialized, 1, memory_order_acquire))
+    return;
+  if (flags()->profile_path[0] == '\0')
+    return;
+  sites.Initialize(kSiteChunkSize);
+  sites.push_back(site_info());
+  add_alloc_site(alloc_site_info());
+  type_table = (type_entry *)MmapOrDie(kTypeTableSize * sizeof(type_entry),
+                                       "typesan type profile");
+  owner_table = (atomic_uint64_t *)MmapOrDie(
+      kOwnerTableSize * sizeof(atomic_uint64_t), "typesan owner profile");
+  retired_profile = new_profile();
+  pthread_key_create(&profile_key, release_thread_profile);
+  atexit(dump_at_exit);
+  profile_enabled = true;
+}
+
+static atomic_uint32_t *site_id(cast_site *site) {
+  return reinterpret_cast<atomic_uint32_t *>(&site->id);
+}
+
+// Called with sites_lock held
+static void register_site(cast_site *site) {
+  if (atomic_load(site_id(site), memory_order_relaxed) != 0)
+    return;
+  site_info info;
+  info.key = site->key;
+  info.dst = site->dst;
+  info.file = internal_strdup(site->file ? site->file : "<unknown>");
+  info.line = site->line;
+  info.column = site->column;
+  sites.push_back(info);
+  atomic_store(site_id(site), sites.size() - 1, memory_order_release);
+}
+
+void profile_cast_slow(cast_site *site, cast_outcome outcome) {
+  u32 id = atomic_load(site_id(site), memory_order_acquire);
+  // Sites checked before the constructor of their DSO ran
+  if (UNLIKELY(id == 0)) {
+    SpinMutexLock lock(&sites_lock);
+    register_site(site);
+    id = atomic_load(site_id(site), memory_order_relaxed);
+  }
+  uptr chunk_index = id / kSiteChunkSize;
+  if (chunk_index >= kMaxSiteChunks)
+    return;
+  site_counters *chunk = (site_counters *)counter_chunk(
+      get_thread_profile()->chunks, chunk_index, sizeof(site_counters));
+  chunk[id % kSiteChunkSize].counts[outcome]++;
+}
+
+static atomic_uint32_t *alloc_site_id(alloc_site *site) {
+  return reinterpret_cast<atomic_uint32_t *>(&site->id);
+}
+
+static alloc_site_counters *alloc_counters(u32 id) {
+  uptr chunk_index = id / kSiteChunkSize;
+  if (chunk_index >= kMaxSiteChunks)
+    return nullptr;
+  alloc_site_counters *chunk = (alloc_site_counters *)counter_chunk(
+      get_thread_profile()->alloc_chunks, chunk_index,
+      sizeof(alloc_site_counters));
+  return &chunk[id % kSiteChunkSize];
+}
+
+static uptr owner_slot(uptr base) {
+  return (base * 0x9E3779B97F4A7C15ULL) >> (64 - kOwnerTableBits);
+}
+
+static type_entry *find_type(u64 hash) {
+  uptr slot = hash % kTypeTableSize;
+  for (uptr probe = 0; probe < kTypeTableProbes; ++probe) {
+    type_entry *entry = &type_table[(slot + probe) % kTypeTableSize];
+    u64 current = atomic_load(&entry->hash, memory_order_acquire);
+    if (current == 0 &&
+        atomic_compare_exchange_strong(&entry->hash, &current, hash,
+                                       memory_order_acq_rel))
+      return entry;
+    if (current == hash)
+      return entry;
+  }
+  atomic_fetch_add(&type_table_overflow, 1, memory_order_relaxed);
+  return nullptr;
+}
+
+// Hash of the type an allocation was made with, from the typeinfo pointer
+// in its metadata: single objects point at their offset-0 entry, arrays at
+// the size field before it. Blacklisted types have no entries.
+static u64 allocation_type_hash(const u64 *type_info) {
+  if (type_info[0] == (u64)-1)
+    return 0;
+  if (type_info[0] != 0) {
+    if (type_info[1] == (u64)-1)
+      return 0;
+    type_info++;
+  }
+  return type_info[1] == (u64)-1 ? 0 : type_info[1];
+}
+
+void profile_cast_source_slow(uptr alloc_base, const u64 *type_info) {
+  u64 hash = allocation_type_hash(type_info);
+  if (hash == 0)
+    return;
+  type_entry *type = find_type(hash);
+  if (type == nullptr)
+    return;
+  atomic_fetch_add(&type->casts, 1, memory_order_relaxed);
+  u64 owner = atomic_load(&owner_table[owner_slot(alloc_base)],
+                          memory_order_relaxed);
+  u32 id = owner & ((1 << kOwnerIdBits) - 1);
+  bool attributed = false;
+  if (owner >> kOwnerIdBits == alloc_base && id != 0) {
+    const alloc_site_info *info = get_alloc_site(id);
+    attributed = info != nullptr && info->type_hash == hash;
+  }
+  alloc_site_counters *counters = attributed ? alloc_counters(id) : nullptr;
+  if (counters != nullptr)
+    counters->casts++;
+  else
+    atomic_fetch_add(&type->unattributed, 1, memory_order_relaxed);
+}
+
+struct profile_writer {
+  fd_t fd;
+  uptr pos;
+  char buf[1 << 16];
+
+  void flush() {
+    const char *data = buf;
+    while (pos > 0) {
+      uptr written = internal_write(fd, data, pos);
+      int err;
+      if (internal_iserror(written, &err)) {
+        if (err == EINTR)
+          continue;
+        break;
+      }
+      data += written;
+      pos -= written;
+    }
+    pos = 0;
+  }
+
+  // One line, strings in it are cut short to fit
+  void print(const char *format, ...) {
+    if (sizeof(buf) - pos < 4096)
+      flush();
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf + pos, sizeof(buf) - pos, format, args);
+    va_end(args);
+    if (len > 0)
+      pos += Min((uptr)len, sizeof(buf) - pos - 1);
+  }
+
+  bool open(const char *path, const char *suffix) {
+    char filename[4096];
+    snprintf(filename, sizeof(filename), "%s.%d%s", path, (int)internal_getpid(),
+             suffix);
+    uptr opened = internal_open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (internal_iserror(opened)) {
+      Report("TypeSan: failed to open profile %s\n", filename);
+      return false;
+    }
+    fd = (fd_t)opened;
+    pos = 0;
+    return true;
+  }
+
+  void close() {
+    flush();
+    internal_close(fd);
+  }
+};
+
+static profile_writer writer;
+
+static void write_cast_sites(const char *path) {
+  if (!writer.open(path, ""))
+    return;
+  writer.print("# typesan-profile 1\n"
+               "# key\tdst\tfile\tline\tcolumn\texec\tnull\tmissing\texact\tslow\tbad\n");
+  for (uptr id = 1; id < sites.size(); ++id) {
+    u64 counts[kOutcomeCount] = {};
+    uptr chunk_index = id / kSiteChunkSize;
+    for (thread_profile *profile = (thread_profile *)atomic_load(
+             &thread_profiles, memory_order_acquire);
+         profile != nullptr && chunk_index < kMaxSiteChunks;
+         profile = profile->next) {
+      site_counters *chunk = (site_counters *)atomic_load(
+          &profile->chunks[chunk_index], memory_order_acquire);
+      if (chunk == nullptr)
+        continue;
+      for (unsigned i = 0; i < kOutcomeCount; ++i)
+        counts[i] += chunk[id % kSiteChunkSize].counts[i];
+    }
+    u64 exec = 0;
+    for (unsigned i = 0; i < kOutcomeCount; ++i)
+      exec += counts[i];
+    const site_info &info = sites[id];
+    writer.print("%016llx\t%016llx\t%.3000s\t%u\t%u\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\n",
+                 (unsigned long long)info.key, (unsigned long long)info.dst,
+                 info.file, info.line, info.column, (unsigned long long)exec,
+                 (unsigned long long)counts[CAST_NULL],
+                 (unsigned long long)counts[CAST_MISSING],
+                 (unsigned long long)counts[CAST_EXACT],
+                 (unsigned long long)counts[CAST_SLOW],
+                 (unsigned long long)counts[CAST_BAD]);
+  }
+  writer.close();
+}
+
+// site lines for allocation sites, type lines for the casts per type
+static void write_alloc_sites(const char *path) {
+  u32 alloc_site_end = atomic_load(&alloc_site_count, memory_order_acquire);
+  if (alloc_site_end <= 1 || !writer.open(path, ".allocs"))
+    return;
+  writer.print("# typesan-alloc-profile 1\n"
+               "# site\ttype_hash\ttype\tfunction\tname\tallocs\tbytes\tcasts\n"
+               "# type\ttype_hash\tcasts\tunattributed\n");
+  writer.print("overflow\t%llu\n",
+               (unsigned long long)atomic_load(&type_table_overflow,
+                                               memory_order_relaxed));
+  for (u32 id = 1; id < alloc_site_end; ++id) {
+    alloc_site_counters counts = {};
+    uptr chunk_index = id / kSiteChunkSize;
+    for (thread_profile *profile = (thread_profile *)atomic_load(
+             &thread_profiles, memory_order_acquire);
+         profile != nullptr && chunk_index < kMaxSiteChunks;
+         profile = profile->next) {
+      alloc_site_counters *chunk = (alloc_site_counters *)atomic_load(
+          &profile->alloc_chunks[chunk_index], memory_order_acquire);
+      if (chunk == nullptr)
+        continue;
+      counts.allocs += chunk[id % kSiteChunkSize].allocs;
+      counts.bytes += chunk[id % kSiteChunkSize].bytes;
+      counts.casts += chunk[id % kSiteChunkSize].casts;
+    }
+    const alloc_site_info &info = *get_alloc_site(id);
+    writer.print("site\t%016llx\t%.1000s\t%.1000s\t%.1500s\t%llu\t%llu\t%llu\n",
+                 (unsigned long long)info.type_hash, info.type, info.function,
+                 info.name, (unsigned long long)counts.allocs,
+                 (unsigned long long)counts.bytes,
+                 (unsigned long long)counts.casts);
+  }
+  for (uptr i = 0; i < kTypeTableSize; ++i) {
+    u64 hash = atomic_load(&type_table[i].hash, memory_order_acquire);
+    if (hash == 0)
+      continue;
+    writer.print("type\t%016llx\t%llu\t%llu\n", (unsigned long long)hash,
+                 (unsigned long long)atomic_load(&type_table[i].casts,
+                                                 memory_order_relaxed),
+                 (unsigned long long)atomic_load(&type_table[i].unattributed,
+                                                 memory_order_relaxed));
+  }
+  writer.close();
+}
+
+}  // namespace __typesan
+
+using namespace __typesan;
+
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __typesan_register_sites(cast_site *start, cast_site *stop) {
+  init_profile();
+  if (!profile_enabled)
+    return;
+  SpinMutexLock lock(&sites_lock);
+  for (cast_site *site = start; site < stop; ++site)
+    register_site(site);
+}
+
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __typesan_profile_alloc(alloc_site *site, uptr base, uptr size) {
+  if (UNLIKELY(atomic_load(&profile_initialized, memory_order_relaxed) == 0))
+    init_profile();
+  if (!profile_enabled)
+    return;
+  u32 id = atomic_load(alloc_site_id(site), memory_order_acquire);
+  if (UNLIKELY(id == 0)) {
+    SpinMutexLock lock(&sites_lock);
+    id = atomic_load(alloc_site_id(site), memory_order_relaxed);
+    if (id == 0) {
+      // Sites beyond the table are not profiled
+      if (alloc_sites_full())
+        return;
+      alloc_site_info info;
+      info.type_hash = site->type_hash;
+      info.type = internal_strdup(site->type);
+      info.function = internal_strdup(site->function);
+      info.name = internal_strdup(site->name);
+      id = add_alloc_site(info);
+      atomic_store(alloc_site_id(site), id, memory_order_release);
+    }
+  }
+  alloc_site_counters *counters = alloc_counters(id);
+  if (counters == nullptr)
+    return;
+  counters->allocs++;
+  counters->bytes += size;
+  if (id < (1 << kOwnerIdBits))
+    atomic_store(&owner_table[owner_slot(base)],
+                 ((u64)base << kOwnerIdBits) | id, memory_order_relaxed);
+}
+
+extern "C" SANITIZER_INTERFACE_ATTRIBUTE
+void __typesan_dump_profile() {
+  if (!profile_enabled)
+    return;
+  const char *path = flags()->profile_path;
+  SpinMutexLock lock(&sites_lock);
+  write_cast_sites(path);
+  write_alloc_sites(path);
+}
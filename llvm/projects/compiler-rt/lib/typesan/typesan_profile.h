@@ -0,0 +1,90 @@
+//===-- typesan_profile.h ---------------------------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Per-cast-site profile of TypeSan. Every check site has a record in the
+// typesan_sites section; the runtime numbers the records when their DSO is
+// loaded and, with the profile_path flag set, counts the outcome of each check in
+// per-thread counters indexed by that number. Code built with
+// -typesan-profile-allocs also reports its tracked allocations, which are
+// weighed against the casts made on the objects.
+//
+//===----------------------------------------------------------------------===//
+#ifndef TYPESAN_PROFILE_H
+#define TYPESAN_PROFILE_H
+
+#include "sanitizer_common/sanitizer_internal_defs.h"
+
+namespace __typesan {
+
+using namespace __sanitizer;
+
+// Layout of the records clang emits into the typesan_sites section.
+struct cast_site {
+  u32 id;
+  u32 flags;
+  u64 key;
+  u64 dst;
+  const char *file;
+  u32 line;
+  u32 column;
+};
+
+// Layout of the records TypeSanUtil emits for each tracked allocation site
+// with -typesan-profile-allocs.
+struct alloc_site {
+  u32 id;
+  u32 flags;
+  u64 type_hash;
+  const char *type;
+  const char *function;
+  const char *name;
+};
+
+enum cast_outcome {
+  CAST_NULL,
+  CAST_MISSING,
+  CAST_EXACT,
+  CAST_SLOW,
+  CAST_BAD,
+};
+
+extern bool profile_enabled;
+
+void profile_cast_slow(cast_site *site, cast_outcome outcome);
+
+// Count one check of site. Costs a single load and branch when profiling
+// is off.
+ALWAYS_INLINE void profile_cast(cast_site *site, cast_outcome outcome) {
+  if (UNLIKELY(profile_enabled) && site != nullptr)
+    profile_cast_slow(site, outcome);
+}
+
+void profile_cast_source_slow(uptr alloc_base, const u64 *type_info);
+
+// Attribute a check that found metadata to the type, and if known the
+// allocation site, of the object it landed in.
+ALWAYS_INLINE void profile_cast_source(uptr alloc_base, const u64 *type_info) {
+  if (UNLIKELY(profile_enabled))
+    profile_cast_source_slow(alloc_base, type_info);
+}
+
+}  // namespace __typesan
+
+extern "C" {
+SANITIZER_INTERFACE_ATTRIBUTE
+void __typesan_register_sites(__typesan::cast_site *start,
+                              __typesan::cast_site *stop);
+SANITIZER_INTERFACE_ATTRIBUTE
+void __typesan_profile_alloc(__typesan::alloc_site *site, __sanitizer::uptr base,
+                             __sanitizer::uptr size);
+SANITIZER_INTERFACE_ATTRIBUTE
+void __typesan_dump_profile();
+}  // extern "C"
+
+#endif  // TYPESAN_PROFILE_H
@@ -0,0 +1,441 @@
+//===-- typesan_report.cc ---------------------------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Asynchronous report stream of TypeSan, see typesan_report.h. Records go
+// to the log_path file, or the log_fd descriptor, stdout by default. Report stacks are unwound into StackDepot on the casting thread
+// and written, symbolized, once per unique stack as a "stack" record that
+// the reports refer to by stack_id.
+//
+//===----------------------------------------------------------------------===//
+
+#include "typesan_report.h"
+#include "typesan_flags.h"
+#include "typesan_names.h"
+
+#include "sanitizer_common/sanitizer_atomic.h"
+#include "sanitizer_common/sanitizer_common.h"
+#include "sanitizer_common/sanitizer_libc.h"
+#include "sanitizer_common/sanitizer_mutex.h"
+#include "sanitizer_common/sanitizer_posix.h"
+#include "sanitizer_common/sanitizer_stackdepot.h"
+#include "sanitizer_common/sanitizer_stacktrace.h"
+#include "sanitizer_common/sanitizer_symbolizer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace __typesan {
+
+const unsigned kReportMaxFrames = 16;
+const unsigned kReportSkipFrames = 2;
+const unsigned kReportRingSize = 128;
+
+struct report_record {
+  u32 kind;
+  u64 tid;
+  u64 values[kReportMaxValues];
+  StackDepotHandle stack;
+};
+
+// Single-producer ring of one thread; the writer is the only consumer.
+// Rings stay on the rings list for good, and those of exited threads are
+// handed to new threads through the free list.
+struct report_ring {
+  atomic_uint64_t head;
+  atomic_uint64_t tail;
+  atomic_uint64_t dropped;
+  report_ring *next;
+  report_ring *free_next;
+  report_record records[kReportRingSize];
+};
+
+static THREADLOCAL report_ring *thread_ring;
+// Stack bounds of the thread, for the fast unwinder
+static THREADLOCAL uptr thread_stack_top;
+static THREADLOCAL uptr thread_stack_bottom;
+static atomic_uintptr_t rings;
+static report_ring *free_rings;
+static StaticSpinMutex free_rings_lock;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static atomic_uint32_t writer_started;
+// Futex word, set while the writer waits for work
+static atomic_uint32_t writer_sleeping;
+static atomic_uint32_t stats_requested;
+static stats_source report_stats_source;
+// Held by whoever drains the rings: the writer thread or flush_reports
+static StaticSpinMutex drain_lock;
+static fd_t report_fd = kInvalidFd;
+
+// Thread exit; records still queued in the ring are written as usual
+static void release_thread_ring(void *arg) {
+  report_ring *ring = (report_ring *)arg;
+  thread_ring = nullptr;
+  SpinMutexLock lock(&free_rings_lock);
+  ring->free_next = free_rings;
+  free_rings = ring;
+}
+
+static void create_ring_key() {
+  pthread_key_create(&ring_key, release_thread_ring);
+}
+
+static report_ring *get_thread_ring() {
+  if (thread_ring != nullptr)
+    return thread_ring;
+  pthread_once(&ring_key_once, create_ring_key);
+  report_ring *ring;
+  {
+    SpinMutexLock lock(&free_rings_lock);
+    ring = free_rings;
+    if (ring != nullptr)
+      free_rings = ring->free_next;
+  }
+  if (ring == nullptr) {
+    ring = (report_ring *)MmapOrDie(sizeof(report_ring), "typesan report ring");
+    uptr head = atomic_load(&rings, memory_order_relaxed);
+    do {
+      ring->next = (report_ring *)head;
+    } while (!atomic_compare_exchange_weak(&rings, &head, (uptr)ring,
+                                           memory_order_release));
+  }
+  pthread_setspecific(ring_key, ring);
+  thread_ring = ring;
+  return ring;
+}
+
+static void open_report_fd() {
+  if (report_fd != kInvalidFd)
+    return;
+  report_fd = flags()->log_fd;
+  if (flags()->log_path[0] != '\0') {
+    uptr fd = internal_open(flags()->log_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (!internal_iserror(fd))
+      report_fd = (fd_t)fd;
+  }
+}
+
+static void write_all(const char *buf, uptr size) {
+  while (size > 0) {
+    uptr written = internal_write(report_fd, buf, size);
+    int err;
+    if (internal_iserror(written, &err)) {
+      if (err == EINTR)
+        continue;
+      return;
+    }
+    buf += written;
+    size -= written;
+  }
+}
+
+static const char *const kReportKindNames[] = {
+    "missing_metadata", "negative_offset", "unknown_offset",
+    "unknown_hash",     "bad_cast",        "stats",
+};
+
+static const char *const kCastValueNames[] = {
+    "src_addr", "dst_addr", "src", "dst", "offset", "typeinfo",
+};
+
+// snprintf at pos, clamping pos to size when the buffer runs out
+static uptr append(char *buf, uptr pos, uptr size, const char *format, ...) {
+  if (pos >= size)
+    return size;
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(buf + pos, size - pos, format, args);
+  va_end(args);
+  return len < 0 ? pos : Min(pos + (uptr)len, size);
+}
+
+// Append a JSON string, escaping the characters JSON cannot carry raw
+static uptr append_json_string(char *buf, uptr pos, uptr size, const char *str) {
+  pos = append(buf, pos, size, "\"");
+  for (; *str && pos + 2 < size; ++str) {
+    if (*str == '"' || *str == '\\')
+      buf[pos++] = '\\';
+    buf[pos++] = (unsigned char)*str < 0x20 ? '?' : *str;
+  }
+  return append(buf, pos, size, "\"");
+}
+
+static uptr append_module(char *buf, uptr pos, uptr size, const char *module,
+                          uptr offset) {
+  pos = append(buf, pos, size, ",\"module\":");
+  pos = append_json_string(buf, pos, size, module);
+  return append(buf, pos, size, ",\"module_offset\":\"0x%zx\"", offset);
+}
+
+// Symbolization happens here, on the writer. Without symbolize, frames keep
+// only module and offset for offline symbolization.
+static uptr append_frame(char *buf, uptr pos, uptr size, uptr pc) {
+  Symbolizer *symbolizer = Symbolizer::GetOrInit();
+  if (!flags()->symbolize) {
+    pos = append(buf, pos, size, "{\"pc\":\"0x%zx\"", pc);
+    const char *module;
+    uptr offset;
+    if (symbolizer->GetModuleNameAndOffsetForPC(pc, &module, &offset))
+      pos = append_module(buf, pos, size, module, offset);
+    return append(buf, pos, size, "}");
+  }
+  // Inlined frames come first, each as a frame of its own
+  SymbolizedStack *frames = symbolizer->SymbolizePC(pc);
+  for (SymbolizedStack *frame = frames; frame != nullptr; frame = frame->next) {
+    const AddressInfo &info = frame->info;
+    pos = append(buf, pos, size, "%s{\"pc\":\"0x%zx\"",
+                 frame == frames ? "" : ",", pc);
+    if (info.module != nullptr)
+      pos = append_module(buf, pos, size, info.module, info.module_offset);
+    if (info.function != nullptr) {
+      pos = append(buf, pos, size, ",\"function\":");
+      pos = append_json_string(buf, pos, size, info.function);
+    }
+    if (info.file != nullptr) {
+      pos = append(buf, pos, size, ",\"file\":");
+      pos = append_json_string(buf, pos, size, info.file);
+      pos = append(buf, pos, size, ",\"line\":%d,\"column\":%d", info.line,
+                   info.column);
+    }
+    pos = append(buf, pos, size, "}");
+  }
+  if (frames != nullptr)
+    frames->ClearAll();
+  return pos;
+}
+
+// Write each unique stack the first time a report refers to it. The depot's
+// use count marks the stacks already written; only the writer touches it,
+// under drain_lock.
+static void write_stack(StackDepotHandle handle) {
+  if (handle.use_count() != 0)
+    return;
+  handle.inc_use_count_unsafe();
+  StackTrace stack = StackDepotGet(handle.id());
+  char buf[8192];
+  uptr size = sizeof(buf) - 1;
+  uptr pos = append(buf, 0, size,
+                    "{\"kind\":\"stack\",\"pid\":%d,\"stack_id\":%u,"
+                    "\"frames\":[",
+                    (int)internal_getpid(), handle.id());
+  for (uptr i = 0; i < stack.size; ++i) {
+    if (i)
+      pos = append(buf, pos, size, ",");
+    pos = append_frame(buf, pos, size, stack.trace[i]);
+  }
+  pos = append(buf, pos, size, "]}");
+  buf[pos++] = '\n';
+  write_all(buf, pos);
+}
+
+static void write_record(const report_record &record) {
+  StackDepotHandle stack = record.stack;
+  if (record.kind != REPORT_STATS && stack.valid())
+    write_stack(stack);
+  char buf[1024];
+  uptr size = sizeof(buf) - 1;
+  uptr pos = append(buf, 0, size, "{\"kind\":\"%s\",\"pid\":%d,\"tid\":%llu",
+                    kReportKindNames[record.kind], (int)internal_getpid(),
+                    (unsigned long long)record.tid);
+  if (record.kind == REPORT_STATS) {
+    pos = append(buf, pos, size, ",\"counters\":[");
+    for (unsigned i = 0; i < kReportMaxValues; ++i)
+      pos = append(buf, pos, size, "%s%llu", i ? "," : "",
+                   (unsigned long long)record.values[i]);
+    pos = append(buf, pos, size, "]");
+  } else {
+    for (unsigned i = 0; i < ARRAY_SIZE(kCastValueNames); ++i)
+      pos = append(buf, pos, size, i == 4 ? ",\"%s\":%lld" : ",\"%s\":%llu",
+                   kCastValueNames[i], (long long)record.values[i]);
+    // Names of src and dst, from the typesan_names sections
+    for (unsigned i = 2; i <= 3; ++i) {
+      char name[512];
+      if (type_name(record.values[i], name, sizeof(name))) {
+        pos = append(buf, pos, size, ",\"%s_type\":", kCastValueNames[i]);
+        pos = append_json_string(buf, pos, size, name);
+      }
+    }
+    if (stack.valid())
+      pos = append(buf, pos, size, ",\"stack_id\":%u", stack.id());
+  }
+  pos = append(buf, pos, size, "}");
+  buf[pos++] = '\n';
+  write_all(buf, pos);
+}
+
+static void drain_rings() {
+  SpinMutexLock lock(&drain_lock);
+  open_report_fd();
+  for (report_ring *ring = (report_ring *)atomic_load(&rings, memory_order_acquire);
+       ring != nullptr; ring = ring->next) {
+    u64 tail = atomic_load(&ring->tail, memory_order_relaxed);
+    u64 head = atomic_load(&ring->head, memory_order_acquire);
+    for (; tail != head; ++tail) {
+      write_record(ring->records[tail % kReportRingSize]);
+      atomic_store(&ring->tail, tail + 1, memory_order_release);
+    }
+    if (u64 dropped = atomic_exchange(&ring->dropped, 0, memory_order_relaxed)) {
+      char buf[128];
+      int len = snprintf(buf, sizeof(buf), "{\"kind\":\"dropped\",\"count\":%llu}\n",
+                         (unsigned long long)dropped);
+      write_all(buf, len);
+    }
+  }
+  if (report_stats_source != nullptr &&
+      atomic_exchange(&stats_requested, 0, memory_order_acquire)) {
+    report_record record;
+    record.kind = REPORT_STATS;
+    record.tid = GetTid();
+    record.stack = StackDepotHandle();
+    internal_memset(record.values, 0, sizeof(record.values));
+    report_stats_source(record.values);
+    write_record(record);
+  }
+}
+
+static bool have_work() {
+  if (report_stats_source != nullptr &&
+      atomic_load(&stats_requested, memory_order_relaxed))
+    return true;
+  for (report_ring *ring = (report_ring *)atomic_load(&rings, memory_order_acquire);
+       ring != nullptr; ring = ring->next) {
+    if (atomic_load(&ring->head, memory_order_relaxed) !=
+            atomic_load(&ring->tail, memory_order_relaxed) ||
+        atomic_load(&ring->dropped, memory_order_relaxed) != 0)
+      return true;
+  }
+  return false;
+}
+
+// Producers publish their work before looking at writer_sleeping, and the
+// writer sets it before looking for work, so one of them sees the other.
+// Called from request_stats in signal handlers too, hence errno is kept.
+static void wake_writer() {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&writer_sleeping, memory_order_relaxed) != 0 &&
+      atomic_exchange(&writer_sleeping, 0, memory_order_relaxed) != 0) {
+    int saved_errno = errno;
+    syscall(SYS_futex, &writer_sleeping, FUTEX_WAKE_PRIVATE, 1, nullptr,
+            nullptr, 0);
+    errno = saved_errno;
+  }
+}
+
+static void *report_writer(void *arg) {
+  for (;;) {
+    drain_rings();
+    atomic_store(&writer_sleeping, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (have_work()) {
+      atomic_store(&writer_sleeping, 0, memory_order_relaxed);
+      continue;
+    }
+    // Returns at once if a producer cleared the word in the meantime
+    syscall(SYS_futex, &writer_sleeping, FUTEX_WAIT_PRIVATE, 1, nullptr,
+            nullptr, 0);
+  }
+  return nullptr;
+}
+
+static void flush_at_exit() {
+  flush_reports();
+}
+
+// Plain pthread_create, as internal_start_thread relies on an interceptor
+// only some sanitizers provide. Signals stay with the application threads.
+static void start_writer() {
+  if (atomic_load(&writer_started, memory_order_relaxed) != 0 ||
+      atomic_exchange(&writer_started, 1, memory_order_acquire) != 0)
+    return;
+  atexit(flush_at_exit);
+  sigset_t blocked, saved;
+  sigfillset(&blocked);
+  pthread_sigmask(SIG_SETMASK, &blocked, &saved);
+  pthread_t writer;
+  if (pthread_create(&writer, nullptr, report_writer, nullptr) == 0)
+    pthread_detach(writer);
+  pthread_sigmask(SIG_SETMASK, &saved, nullptr);
+}
+
+static report_record *begin_record(report_ring *ring) {
+  u64 head = atomic_load(&ring->head, memory_order_relaxed);
+  u64 tail = atomic_load(&ring->tail, memory_order_acquire);
+  if (head - tail == kReportRingSize) {
+    atomic_fetch_add(&ring->dropped, 1, memory_order_relaxed);
+    return nullptr;
+  }
+  report_record *record = &ring->records[head % kReportRingSize];
+  record->tid = GetTid();
+  return record;
+}
+
+static void commit_record(report_ring *ring) {
+  u64 head = atomic_load(&ring->head, memory_order_relaxed);
+  atomic_store(&ring->head, head + 1, memory_order_release);
+  start_writer();
+  wake_writer();
+}
+
+// Unwind the reporting thread into the depot, skipping this frame and
+// report_cast
+static NOINLINE StackDepotHandle unwind_report_stack() {
+  bool fast = flags()->fast_unwind_on_report;
+  if (fast && thread_stack_top == 0) {
+    uptr stack_top, stack_bottom;
+    GetThreadStackTopAndBottom(false, &stack_top, &stack_bottom);
+    thread_stack_bottom = stack_bottom;
+    thread_stack_top = stack_top;
+  }
+  BufferedStackTrace stack;
+  stack.Unwind(kReportMaxFrames + kReportSkipFrames,
+               StackTrace::GetCurrentPc(), GET_CURRENT_FRAME(), nullptr,
+               thread_stack_top, thread_stack_bottom, fast);
+  if (stack.size <= kReportSkipFrames)
+    return StackDepotHandle();
+  return StackDepotPut_WithHandle(StackTrace(stack.trace + kReportSkipFrames,
+                                             stack.size - kReportSkipFrames));
+}
+
+void report_cast(report_kind kind, uptr src_addr, uptr dst_addr, u64 src,
+                 u64 dst, sptr offset, uptr type_info) {
+  report_ring *ring = get_thread_ring();
+  report_record *record = begin_record(ring);
+  if (record == nullptr)
+    return;
+  record->kind = kind;
+  u64 values[kReportMaxValues] = {src_addr, dst_addr, src, dst, (u64)offset,
+                                  type_info};
+  internal_memcpy(record->values, values, sizeof(values));
+  record->stack = unwind_report_stack();
+  commit_record(ring);
+}
+
+void set_stats_source(stats_source source) {
+  report_stats_source = source;
+  start_writer();
+}
+
+void request_stats() {
+  atomic_store(&stats_requested, 1, memory_order_release);
+  wake_writer();
+}
+
+void flush_reports() {
+  drain_rings();
+}
+
+}  // namespace __typesan
@@ -0,0 +1,57 @@
+//===-- typesan_report.h ----------------------------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Asynchronous report stream of TypeSan. Casting threads only copy a fixed
+// size record with a StackDepot stack into a per-thread ring; a background
+// thread symbolizes and writes them as JSON lines.
+//
+//===----------------------------------------------------------------------===//
+#ifndef TYPESAN_REPORT_H
+#define TYPESAN_REPORT_H
+
+#include "sanitizer_common/sanitizer_internal_defs.h"
+
+namespace __typesan {
+
+using namespace __sanitizer;
+
+enum report_kind {
+  REPORT_MISSING_METADATA,
+  REPORT_NEGATIVE_OFFSET,
+  REPORT_UNKNOWN_OFFSET,
+  REPORT_UNKNOWN_HASH,
+  REPORT_BAD_CAST,
+  REPORT_STATS,
+};
+
+const unsigned kReportMaxValues = 8;
+
+// Queue a cast report. Never blocks; the report is dropped (and counted) if
+// the thread's ring is full.
+void report_cast(report_kind kind, uptr src_addr, uptr dst_addr, u64 src,
+                 u64 dst, sptr offset, uptr type_info);
+
+// Fills in up to kReportMaxValues counters and returns how many it wrote.
+typedef unsigned (*stats_source)(u64 *values);
+
+// Set the counters written by REPORT_STATS records and start the writer
+// thread, from a regular constructor.
+void set_stats_source(stats_source source);
+
+// Ask the writer thread for a REPORT_STATS record. Only sets a flag, so it
+// is safe to call from a signal handler.
+void request_stats();
+
+// Write out everything queued so far, from the calling thread. For the fatal
+// path and process exit only.
+void flush_reports();
+
+}  // namespace __typesan
+
+#endif  // TYPESAN_REPORT_H
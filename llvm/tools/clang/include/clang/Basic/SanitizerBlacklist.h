@@ -34,7 +34,8 @@ public:
                            StringRef Category = StringRef()) const;
   bool isBlacklistedType(StringRef MangledTypeName,
                          StringRef Category = StringRef()) const;
-  bool isBlacklistedFunction(StringRef FunctionName) const;
+  bool isBlacklistedFunction(StringRef FunctionName,
+                             StringRef Category = StringRef()) const;
   bool isBlacklistedFile(StringRef FileName,
                          StringRef Category = StringRef()) const;
   bool isBlacklistedLocation(SourceLocation Loc,
@@ -29,8 +29,9 @@ bool SanitizerBlacklist::isBlacklistedType(StringRef MangledTypeName,
   return SCL->inSection("type", MangledTypeName, Category);
 }
 
-bool SanitizerBlacklist::isBlacklistedFunction(StringRef FunctionName) const {
-  return SCL->inSection("fun", FunctionName);
+bool SanitizerBlacklist::isBlacklistedFunction(StringRef FunctionName,
+                                               StringRef Category) const {
+  return SCL->inSection("fun", FunctionName, Category);
 }
 
 bool SanitizerBlacklist::isBlacklistedFile(StringRef FileName,
@@ -2605,6 +2605,20 @@ void remove_useless_str(std::string& str) {
 		str.erase(i, basesuffix.length());
 }
 
+// Key of a cast site that stays the same across builds of unchanged code,
+// so that profiles can be matched back to it: the hash of its presumed
+// location and destination type.
+static uint64_t GetTypeSanSiteKey(CodeGenFunction &CGF, SourceLocation Loc,
+                                  const std::string &dstStr) {
+	PresumedLoc PLoc = CGF.getContext().getSourceManager().getPresumedLoc(Loc);
+	std::string site;
+	if (PLoc.isValid()) {
+		site = std::string(PLoc.getFilename()) + ":" + std::to_string(PLoc.getLine()) +
+			":" + std::to_string(PLoc.getColumn());
+	}
+	return GetHashValue(site + ":" + dstStr);
+}
+
 void CodeGenFunction::EmitTypeSanCheckForCast(QualType T,
                                                 llvm::Value *Base,
                                                 bool MayBeNull,
@@ -2617,10 +2631,6 @@ void CodeGenFunction::EmitTypeSanCheckForCast(QualType T,
 
 	const CXXRecordDecl *ClassDecl = cast<CXXRecordDecl>(ClassTy->getDecl());
 	if (ClassDecl->isCompleteDefinition() && ClassDecl && ClassDecl->hasDefinition() && !ClassDecl->isAnonymousStructOrUnion()) {
-		llvm::Constant *StaticData[] = {
-			EmitCheckSourceLocation(Loc),
-		};
-
 		auto &layout = getTypes().getCGRecordLayout(ClassDecl);
 		std::string dstStr = layout.getLLVMType()->getName();
 		remove_useless_str(dstStr);
@@ -2628,7 +2638,17 @@ void CodeGenFunction::EmitTypeSanCheckForCast(QualType T,
 		llvm::Value *cast =  llvm::ConstantInt::get(Int64Ty, dstValue);
 		llvm::Value *DynamicArgs[] = { Base, cast };
 
-		TypeSanEmitCheck("__type_casting_verification", StaticData,
+		// Cast site record: compact id and flags (filled in by the runtime),
+		// site key, destination hash and source location
+		llvm::Constant *StaticData[] = {
+			Builder.getInt32(0),
+			Builder.getInt32(0),
+			llvm::ConstantInt::get(Int64Ty, GetTypeSanSiteKey(*this, Loc, dstStr)),
+			llvm::ConstantInt::get(Int64Ty, dstValue),
+			EmitCheckSourceLocation(Loc),
+		};
+
+		TypeSanEmitCheck("__type_casting_verification_site", StaticData,
 				DynamicArgs, dstStr, dstValue);
 	}
 }
@@ -2646,10 +2666,6 @@ void CodeGenFunction::EmitTypeSanCheckForChangingCast(QualType T,
 
 	const CXXRecordDecl *ClassDecl = cast<CXXRecordDecl>(ClassTy->getDecl());
 	if (ClassDecl->isCompleteDefinition() && ClassDecl && ClassDecl->hasDefinition() && !ClassDecl->isAnonymousStructOrUnion()) {
-		llvm::Constant *StaticData[] = {
-			EmitCheckSourceLocation(Loc),
-		};
-
 		auto &layout = getTypes().getCGRecordLayout(ClassDecl);
 		std::string dstStr = layout.getLLVMType()->getName();
 		remove_useless_str(dstStr);
@@ -2657,7 +2673,17 @@ void CodeGenFunction::EmitTypeSanCheckForChangingCast(QualType T,
 		llvm::Value *cast =  llvm::ConstantInt::get(Int64Ty, dstValue);
 		llvm::Value *DynamicArgs[] = { Base, Derived, cast };
 
-		TypeSanEmitCheck("__changing_type_casting_verification", StaticData,
+		// Cast site record: compact id and flags (filled in by the runtime),
+		// site key, destination hash and source location
+		llvm::Constant *StaticData[] = {
+			Builder.getInt32(0),
+			Builder.getInt32(0),
+			llvm::ConstantInt::get(Int64Ty, GetTypeSanSiteKey(*this, Loc, dstStr)),
+			llvm::ConstantInt::get(Int64Ty, dstValue),
+			EmitCheckSourceLocation(Loc),
+		};
+
+		TypeSanEmitCheck("__changing_type_casting_verification_site", StaticData,
 				DynamicArgs, dstStr, dstValue);
 	}
 }
@@ -2457,11 +2457,16 @@ void CodeGenFunction::TypeSanEmitCheck(
   blacklisted = CGM.getContext().getSanitizerBlacklist().isBlacklistedFunction(CurFn->getName()) ? 1 : 0;
   if (blacklisted) return;
 
+  // The cast site record is written by the runtime, which numbers the
+  // sites of each DSO from the typesan_sites section at load time.
   llvm::Constant *Info = llvm::ConstantStruct::getAnon(StaticArgs);
   auto *InfoPtr =
       new llvm::GlobalVariable(CGM.getModule(), Info->getType(), false,
-                               llvm::GlobalVariable::PrivateLinkage, Info);
+                               llvm::GlobalVariable::PrivateLinkage, Info,
+                               "__typesan_site");
   InfoPtr->setUnnamedAddr(true);
+  InfoPtr->setSection("typesan_sites");
+  InfoPtr->setAlignment(8);
   CGM.getSanitizerMetadata()->disableSanitizerForGlobal(InfoPtr);
 
   SmallVector<llvm::Value *, 4> Args;
@@ -2469,15 +2474,14 @@ void CodeGenFunction::TypeSanEmitCheck(
   Args.reserve(DynamicArgs.size() + 1);
   ArgTypes.reserve(DynamicArgs.size() + 1);
 
-  // Handler functions take an i8* pointing to the (handler-specific) static
-  // information block, followed by a sequence of intptr_t arguments
-  // representing operand values.
-  //Args.push_back(Builder.CreateBitCast(InfoPtr, Int8PtrTy));
-  //ArgTypes.push_back(Int8PtrTy);
+  // Handler functions take a sequence of intptr_t arguments representing
+  // operand values, followed by the address of the cast site record.
   for (size_t i = 0, n = DynamicArgs.size(); i != n; ++i) {
     Args.push_back(EmitCheckValue(DynamicArgs[i]));
     ArgTypes.push_back(IntPtrTy);
   }
+  Args.push_back(EmitCheckValue(InfoPtr));
+  ArgTypes.push_back(IntPtrTy);
 
   llvm::AttrBuilder B;
   B.addAttribute(llvm::Attribute::UWTable);
@@ -1309,6 +1309,26 @@ static void EnterNewDeleteCleanup(CodeGenFunction &CGF,
   CGF.initFullExprCleanup();
 }
 
+/// TypeSan only sees objects allocated through the standard allocators, so
+/// objects placed into memory obtained elsewhere are announced with a marker
+/// call. TypeSanTreePass replaces it by the metadata registration once it
+/// knows the layout of the element type, carried by the null third operand.
+static void EmitTypeSanPlacementNew(CodeGenFunction &CGF, Address Result,
+                                    llvm::Value *NumElements) {
+  CGBuilderTy &Builder = CGF.Builder;
+  llvm::Value *Count = NumElements
+                           ? Builder.CreateZExtOrTrunc(NumElements, CGF.Int64Ty)
+                           : Builder.getInt64(1);
+  llvm::FunctionType *FTy = llvm::FunctionType::get(
+      CGF.VoidTy, {CGF.Int8PtrTy, CGF.Int64Ty}, /*isVarArg=*/true);
+  llvm::Constant *Marker =
+      CGF.CGM.CreateRuntimeFunction(FTy, "__typesan_placement_new");
+  llvm::Value *Args[] = {
+      Builder.CreateBitCast(Result.getPointer(), CGF.Int8PtrTy), Count,
+      llvm::Constant::getNullValue(Result.getType())};
+  CGF.EmitNounwindRuntimeCall(Marker, Args);
+}
+
 llvm::Value *CodeGenFunction::EmitCXXNewExpr(const CXXNewExpr *E) {
   // The element type being allocated.
   QualType allocType = getContext().getBaseElementType(E->getAllocatedType());
@@ -1444,6 +1464,13 @@ llvm::Value *CodeGenFunction::EmitCXXNewExpr(const CXXNewExpr *E) {
     result = Address(Builder.CreateInvariantGroupBarrier(result.getPointer()),
                      result.getAlignment());
 
+  // Placement forms of operator new, other than the replaceable nothrow
+  // one, allocate behind TypeSan's back; describe the objects before their
+  // constructors run
+  if (SanOpts.has(SanitizerKind::TypeSan) && E->getNumPlacementArgs() != 0 &&
+      !allocator->isReplaceableGlobalAllocationFunction())
+    EmitTypeSanPlacementNew(*this, result, numElements);
+
   EmitNewInitializer(*this, E, allocType, elementTy, result, numElements,
                      allocSizeWithoutCookie);
   if (E->isArray()) {
@@ -696,6 +696,11 @@ void CodeGenFunction::StartFunction(GlobalDecl GD,
     Fn->addFnAttr(llvm::Attribute::SanitizeMemory);
   if (SanOpts.has(SanitizerKind::SafeStack))
     Fn->addFnAttr(llvm::Attribute::SafeStack);
+  // TypeSan keeps the objects of fun:<name>=metadata entries untracked
+  if (SanOpts.has(SanitizerKind::TypeSan) &&
+      CGM.getContext().getSanitizerBlacklist().isBlacklistedFunction(
+          Fn->getName(), "metadata"))
+    Fn->addFnAttr("typesan-no-stack-metadata");
 
   // Pass inline keyword to optimizer if it appears explicitly on any
   // declaration. Also, in the case of -fno-inline attach NoInline
@@ -2,6 +2,11 @@
 #include <string.h>               // for memchr
 #include <stdlib.h>               // for getenv
 #include <stdio.h>                // for printf
+#include <errno.h>                // for errno
+#include <signal.h>               // for sigaction
+#include <unistd.h>               // for read, write
+#include <pthread.h>              // for pthread_key_create
+#include <malloc.h>               // for malloc_usable_size
 #include <metapagetable.h>
 #include "../gperftools-metalloc/src/base/linux_syscall_support.h"
 
@@ -28,6 +33,21 @@ int is_fixed_compression() {
     return FLAGS_METALLOC_FIXEDCOMPRESSION ? 1 : 0;
 }
 
+// Reserved and committed bytes per metalloc_usage_category
+static unsigned long usageReserved[METALLOC_USAGE_CATEGORIES];
+static unsigned long usageCommitted[METALLOC_USAGE_CATEGORIES];
+
+static inline void metadata_usage_add(int category, long reserved, long committed) {
+    __atomic_fetch_add(&usageReserved[category], reserved, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&usageCommitted[category], committed, __ATOMIC_RELAXED);
+}
+
+// One bit per page of the page table that entries were written to. Pages
+// of the page table are never released, so these are the committed ones,
+// counted without asking the kernel.
+#define PAGETABLEPAGES (PAGETABLESIZE * sizeof(unsigned long) / METALLOC_PAGESIZE)
+static unsigned long *pageTableTouched;
+
 void page_table_init() {
     if (unlikely(!isPageTableAlloced)) {
         void *pageTableMap = sys_mmap(pageTable, PAGETABLESIZE * sizeof(unsigned long), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
@@ -35,10 +55,31 @@ void page_table_init() {
             perror("Could not allocate pageTable");
             exit(-1);
         }
+        pageTableTouched = sys_mmap(NULL, PAGETABLEPAGES / 8, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (pageTableTouched == MAP_FAILED) {
+            perror("Could not allocate pageTable bitmap");
+            exit(-1);
+        }
+        metadata_usage_add(METALLOC_USAGE_PAGETABLE, PAGETABLESIZE * sizeof(unsigned long) + PAGETABLEPAGES / 8, 0);
         isPageTableAlloced = true;
     }
 }
 
+// Account the page-table pages holding the entries of count pages from page
+static void page_table_touch(unsigned long page, unsigned long count) {
+    if (count == 0)
+        return;
+    unsigned long first = page * sizeof(unsigned long) / METALLOC_PAGESIZE;
+    unsigned long last = (page + count - 1) * sizeof(unsigned long) / METALLOC_PAGESIZE;
+    for (unsigned long ptPage = first; ptPage <= last; ++ptPage) {
+        unsigned long *word = &pageTableTouched[ptPage / 64];
+        unsigned long bit = (unsigned long)1 << (ptPage % 64);
+        if ((__atomic_load_n(word, __ATOMIC_RELAXED) & bit) == 0 &&
+                (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit) == 0)
+            metadata_usage_add(METALLOC_USAGE_PAGETABLE, 0, METALLOC_PAGESIZE);
+    }
+}
+
 __attribute__((section(".init_array"), used))
 void (*init_func1)(void) = page_table_init;
 
@@ -46,29 +87,286 @@ bool is_metapagetable_alloced() {
     return isPageTableAlloced;
 }
 
-void* allocate_metadata(unsigned long size, unsigned long alignment) {
-    /*if (unlikely(isPageTableAlloced == false))
-        page_table_init();*/
+// All metadata regions are carved from large NORESERVE arenas, so that
+// threads, DSOs and spans do not each add a mapping of their own. Blocks are
+// power-of-two sized and recycled through per-size free lists; freed blocks
+// are zeroed again (large ones by dropping their pages) before reuse.
+#define METAARENASIZE ((unsigned long)1 << 36)
+#define METABLOCKMINSHIFT 6
+#define METABLOCKMAXSHIFT 34
+#define METABLOCKRELEASESHIFT 16
+#define METABLOCKHEADER 16
+
+static void *metaBlockFreeLists[METABLOCKMAXSHIFT + 1];
+static char *metaArenaCurrent = NULL;
+static char *metaArenaEnd = NULL;
+static int metaArenaLock = 0;
+
+static inline void meta_arena_lock(void) {
+    while (__sync_lock_test_and_set(&metaArenaLock, 1)) {
+        while (metaArenaLock)
+            __builtin_ia32_pause();
+    }
+}
+
+static inline void meta_arena_unlock(void) {
+    __sync_lock_release(&metaArenaLock);
+}
+
+static inline unsigned long metadata_block_shift(unsigned long size) {
+    unsigned long shift = METABLOCKMINSHIFT;
+    while (((unsigned long)1 << shift) < size)
+        shift++;
+    return shift;
+}
+
+static void *metadata_block_alloc(unsigned long size, int category) {
+    unsigned long shift = metadata_block_shift(size);
+    if (unlikely(shift > METABLOCKMAXSHIFT)) {
+        void *block = sys_mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (block == MAP_FAILED)
+            return NULL;
+        metadata_usage_add(category, size, size);
+        return block;
+    }
+    unsigned long blockSize = (unsigned long)1 << shift;
+    unsigned long blockAlign = (blockSize < SYSTEM_PAGESIZE) ? blockSize : SYSTEM_PAGESIZE;
+    meta_arena_lock();
+    char *block = metaBlockFreeLists[shift];
+    if (block != NULL) {
+        metaBlockFreeLists[shift] = *(void**)block;
+        *(void**)block = NULL;
+        // Released blocks no longer count as resident while free
+        metadata_usage_add(METALLOC_USAGE_ARENA, -blockSize,
+            (shift >= METABLOCKRELEASESHIFT) ? 0 : -blockSize);
+    } else {
+        block = (char*)(((unsigned long)metaArenaCurrent + blockAlign - 1) & ~(blockAlign - 1));
+        if (unlikely(metaArenaCurrent == NULL || block + blockSize > metaArenaEnd)) {
+            unsigned long arenaSize = (blockSize > METAARENASIZE) ? blockSize : METAARENASIZE;
+            char *arena = sys_mmap(NULL, arenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (unlikely(arena == MAP_FAILED)) {
+                meta_arena_unlock();
+                return NULL;
+            }
+            metaArenaEnd = arena + arenaSize;
+            block = arena;
+            metadata_usage_add(METALLOC_USAGE_ARENA, arenaSize, 0);
+        }
+        metaArenaCurrent = block + blockSize;
+        metadata_usage_add(METALLOC_USAGE_ARENA, -blockSize, 0);
+    }
+    meta_arena_unlock();
+    metadata_usage_add(category, blockSize, size);
+    return block;
+}
+
+static void metadata_block_free(void *ptr, unsigned long size, int category) {
+    unsigned long shift = metadata_block_shift(size);
+    if (unlikely(shift > METABLOCKMAXSHIFT)) {
+        munmap(ptr, size);
+        metadata_usage_add(category, -size, -size);
+        return;
+    }
+    unsigned long blockSize = (unsigned long)1 << shift;
+    unsigned long blockStart = (unsigned long)ptr;
+    unsigned long blockEnd = blockStart + blockSize;
+    if (shift >= METABLOCKRELEASESHIFT) {
+        // Hand the whole pages back to the system, they read as zero afterwards
+        unsigned long releaseStart = (blockStart + SYSTEM_PAGESIZE - 1) & ~((unsigned long)SYSTEM_PAGESIZE - 1);
+        unsigned long releaseEnd = blockEnd & ~((unsigned long)SYSTEM_PAGESIZE - 1);
+        madvise((void*)releaseStart, releaseEnd - releaseStart, MADV_DONTNEED);
+        memset((void*)blockStart, 0, releaseStart - blockStart);
+        memset((void*)releaseEnd, 0, blockEnd - releaseEnd);
+    } else {
+        memset(ptr, 0, blockSize);
+    }
+    metadata_usage_add(category, -blockSize, -size);
+    meta_arena_lock();
+    *(void**)ptr = metaBlockFreeLists[shift];
+    metaBlockFreeLists[shift] = ptr;
+    metadata_usage_add(METALLOC_USAGE_ARENA, blockSize,
+        (shift >= METABLOCKRELEASESHIFT) ? 0 : blockSize);
+    meta_arena_unlock();
+}
+
+static inline unsigned long metadata_region_size(unsigned long size, unsigned long alignment) {
     unsigned long pageAlignOffset = SYSTEM_PAGESIZE - 1;
     unsigned long pageAlignMask = ~((unsigned long)SYSTEM_PAGESIZE - 1);
-    unsigned long metadataSize = (((size * FLAGS_METALLOC_METADATABYTES) >> alignment) + pageAlignOffset) & pageAlignMask;
-    void *metadata = sys_mmap(NULL, metadataSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
-    if (unlikely(metadata == MAP_FAILED)) {
+    return (((size * FLAGS_METALLOC_METADATABYTES) >> alignment) + pageAlignOffset) & pageAlignMask;
+}
+
+void* allocate_category_metadata(unsigned long size, unsigned long alignment, int category) {
+    /*if (unlikely(isPageTableAlloced == false))
+        page_table_init();*/
+    void *metadata = metadata_block_alloc(metadata_region_size(size, alignment), category);
+    if (unlikely(metadata == NULL)) {
         perror("Could not allocate metadata");
         exit(-1);
     }
+    METALLOC_PROBE3(metadata__alloc, metadata, size, alignment);
     return metadata;
 }
 
-void deallocate_metadata(void *ptr, unsigned long size, unsigned long alignment) {
-    unsigned long pageAlignOffset = SYSTEM_PAGESIZE - 1;
-    unsigned long pageAlignMask = ~((unsigned long)SYSTEM_PAGESIZE - 1);
-    unsigned long metadata = pageTable[((unsigned long)ptr) / METALLOC_PAGESIZE] >> 8;
-    unsigned long metadataSize = (((size * FLAGS_METALLOC_METADATABYTES) >> alignment) + pageAlignOffset) & pageAlignMask;
-    munmap((void*)metadata, metadataSize);
+void deallocate_category_metadata(void *ptr, unsigned long size, unsigned long alignment, int category) {
+    void *metadata = metapagetable_entry_base(pageTable[((unsigned long)ptr) / METALLOC_PAGESIZE]);
+    METALLOC_PROBE3(metadata__free, metadata, size, alignment);
+    metadata_block_free(metadata, metadata_region_size(size, alignment), category);
     return;
 }
 
+void* allocate_metadata(unsigned long size, unsigned long alignment) {
+    return allocate_category_metadata(size, alignment, METALLOC_USAGE_OTHER);
+}
+
+void deallocate_metadata(void *ptr, unsigned long size, unsigned long alignment) {
+    deallocate_category_metadata(ptr, size, alignment, METALLOC_USAGE_OTHER);
+}
+
+// Span metadata blocks carry a header with their size, as the page heap
+// only knows the span when releasing them
+void *allocate_span_metadata(unsigned long size) {
+    char *block = metadata_block_alloc(size + METABLOCKHEADER, METALLOC_USAGE_SPANS);
+    if (unlikely(block == NULL))
+        return NULL;
+    *(unsigned long*)block = size + METABLOCKHEADER;
+    METALLOC_PROBE2(span__alloc, block + METABLOCKHEADER, size);
+    return block + METABLOCKHEADER;
+}
+
+void deallocate_span_metadata(void *ptr) {
+    char *block = (char*)ptr - METABLOCKHEADER;
+    METALLOC_PROBE2(span__free, ptr, *(unsigned long*)block - METABLOCKHEADER);
+    metadata_block_free(block, *(unsigned long*)block, METALLOC_USAGE_SPANS);
+}
+
+static const char *usageCategoryNames[METALLOC_USAGE_CATEGORIES] = {
+    "pagetable", "spans", "stacks", "globals", "safestack", "other", "arena",
+};
+
+const char *metalloc_usage_category_name(int category) {
+    if (category < 0 || category >= METALLOC_USAGE_CATEGORIES)
+        return "unknown";
+    return usageCategoryNames[category];
+}
+
+void metalloc_get_usage(struct metalloc_usage usage[METALLOC_USAGE_CATEGORIES]) {
+    for (int i = 0; i < METALLOC_USAGE_CATEGORIES; ++i) {
+        usage[i].reserved = __atomic_load_n(&usageReserved[i], __ATOMIC_RELAXED);
+        usage[i].committed = __atomic_load_n(&usageCommitted[i], __ATOMIC_RELAXED);
+    }
+}
+
+// Usage table text, formatted without stdio as it is also written from a
+// signal handler. Output past the buffer is cut off.
+struct usage_text {
+    char *buffer;
+    int length;
+    int written;
+};
+
+static void usage_put_char(struct usage_text *text, char c) {
+    if (text->written < text->length - 1)
+        text->buffer[text->written++] = c;
+}
+
+// Right-aligned to width, or left-aligned to -width
+static void usage_put_string(struct usage_text *text, const char *s, int width) {
+    int length = strlen(s);
+    for (int i = length; i < width; ++i)
+        usage_put_char(text, ' ');
+    for (int i = 0; i < length; ++i)
+        usage_put_char(text, s[i]);
+    for (int i = length; i < -width; ++i)
+        usage_put_char(text, ' ');
+}
+
+static void usage_put_number(struct usage_text *text, unsigned long value, int width) {
+    char digits[24];
+    char *first = &digits[sizeof(digits) - 1];
+    *first = '\0';
+    do {
+        *--first = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    usage_put_string(text, first, width);
+}
+
+// Bytes as " (%9.1f)" MiB, rounded to tenths
+static void usage_put_mib(struct usage_text *text, unsigned long bytes) {
+    static const unsigned long MiB = 1024 * 1024;
+    unsigned long tenths = (bytes / MiB) * 10 + ((bytes % MiB) * 10 + MiB / 2) / MiB;
+    usage_put_string(text, " (", 0);
+    usage_put_number(text, tenths / 10, 7);
+    usage_put_char(text, '.');
+    usage_put_char(text, '0' + tenths % 10);
+    usage_put_char(text, ')');
+}
+
+// Same layout as the MALLOC: lines of tcmalloc's stats, which include it
+int metalloc_print_usage(char *buffer, int length) {
+    struct metalloc_usage usage[METALLOC_USAGE_CATEGORIES];
+    struct metalloc_usage total = { 0, 0 };
+    struct usage_text text = { buffer, length, 0 };
+    if (length <= 0)
+        return 0;
+    metalloc_get_usage(usage);
+    usage_put_string(&text, "------------------------------------------------\n"
+        "METALLOC: metadata       reserved       (MiB)    committed       (MiB)\n", 0);
+    for (int i = 0; i <= METALLOC_USAGE_CATEGORIES; ++i) {
+        struct metalloc_usage *line = (i < METALLOC_USAGE_CATEGORIES) ? &usage[i] : &total;
+        usage_put_string(&text, "METALLOC: ", 0);
+        usage_put_string(&text, (i < METALLOC_USAGE_CATEGORIES) ? usageCategoryNames[i] : "total", -10);
+        usage_put_char(&text, ' ');
+        usage_put_number(&text, line->reserved, 12);
+        usage_put_mib(&text, line->reserved);
+        usage_put_char(&text, ' ');
+        usage_put_number(&text, line->committed, 12);
+        usage_put_mib(&text, line->committed);
+        usage_put_char(&text, '\n');
+        if (i < METALLOC_USAGE_CATEGORIES) {
+            total.reserved += usage[i].reserved;
+            total.committed += usage[i].committed;
+        }
+    }
+    buffer[text.written] = '\0';
+    return text.written;
+}
+
+// Runs in a signal handler: everything it calls is async-signal-safe, and
+// errno is left as the interrupted code had it
+static void metalloc_usage_dump(int signum) {
+    int savedErrno = errno;
+    char buffer[2048];
+    int length = metalloc_print_usage(buffer, sizeof(buffer));
+    while (length > 0) {
+        ssize_t count = write(STDERR_FILENO, buffer, length);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            break;
+        memmove(buffer, buffer + count, length - count);
+        length -= count;
+    }
+    errno = savedErrno;
+}
+
+// METALLOC_USAGE_SIGNAL=<signum> dumps the usage table to stderr on that
+// signal, for processes that cannot be asked through MallocExtension
+static void metalloc_usage_init(void) {
+    const char *signum = getenv("METALLOC_USAGE_SIGNAL");
+    if (signum == NULL || *signum == '\0')
+        return;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = metalloc_usage_dump;
+    action.sa_flags = SA_RESTART;
+    if (sigaction(atoi(signum), &action, NULL) != 0)
+        perror("Could not install METALLOC_USAGE_SIGNAL handler");
+}
+
+__attribute__((section(".init_array"), used))
+void (*init_func2)(void) = metalloc_usage_init;
+
 void set_metapagetable_entries(void *ptr, unsigned long size, void *metaptr, int alignment) {
     if (unlikely(isPageTableAlloced == false))
         page_table_init();
@@ -92,7 +390,55 @@ void set_metapagetable_entries(void *ptr, unsigned long size, void *metaptr, int
         else 
             pageMetaptr = (unsigned long)metaptr + metaOffset;
         pageTable[page + i] = (pageMetaptr << 8) | (char)alignment;
+    }    page_table_touch(page, count);
+}
+
+// Reciprocals (ceil(2^32 / size)) and sizes of the registered object classes
+unsigned int metalloc_object_reciprocals[METALLOC_OBJECTCLASSES];
+static unsigned long objectClassSizes[METALLOC_OBJECTCLASSES];
+static int objectClassCount = 0;
+
+int get_metapagetable_object_class(unsigned long objsize) {
+    // Power-of-two sizes already get a single granule per object
+    if (objsize == 0 || objsize > METALLOC_OBJECTMAXSIZE || (objsize & (objsize - 1)) == 0)
+        return -1;
+    for (int i = 0; i < objectClassCount; ++i) {
+        if (objectClassSizes[i] == objsize)
+            return i;
     }
+    if (unlikely(objectClassCount == METALLOC_OBJECTCLASSES))
+        return -1;
+    // The multiply-shift is exact as long as (pageOffset + phase) * error
+    // stays below 2^32, which holds for object sizes up to METALLOC_PAGESIZE
+    int objclass = objectClassCount;
+    objectClassSizes[objclass] = objsize;
+    __atomic_store_n(&metalloc_object_reciprocals[objclass],
+        (unsigned int)((((unsigned long)1 << METALLOC_OBJECTRECIPROCALSHIFT) + objsize - 1) / objsize), __ATOMIC_RELEASE);
+    objectClassCount++;
+    return objclass;
+}
+
+void set_metapagetable_object_entries(void *ptr, unsigned long size, void *metaptr, unsigned long objsize, int objclass) {
+    if (unlikely(isPageTableAlloced == false))
+        page_table_init();
+    if (unlikely(size % METALLOC_PAGESIZE != 0)) {
+        printf("Meta-pagetable must be configured for ranges that are multiple of METALLOC_PAGESIZE");
+        exit(-1);
+    }
+    unsigned long page = (unsigned long)ptr / METALLOC_PAGESIZE;
+    unsigned long count = size / METALLOC_PAGESIZE;
+    for (unsigned long i = 0; i < count; ++i) {
+        // Locate the first object overlapping the page and its distance to the page start
+        unsigned long object = (i * METALLOC_PAGESIZE) / objsize;
+        unsigned long phase = i * METALLOC_PAGESIZE - object * objsize;
+        unsigned long pageMetaptr = (unsigned long)metaptr + object * FLAGS_METALLOC_METADATABYTES;
+        pageTable[page + i] = ((pageMetaptr >> 3) << METALLOC_OBJECTMETASHIFT) |
+            (phase << METALLOC_OBJECTPHASESHIFT) | METALLOC_OBJECTFLAG | objclass;
+    }    page_table_touch(page, count);
+}
+
+void *get_metapagetable_metabase(void *ptr) {
+    return metapagetable_entry_base(get_metapagetable_entry(ptr));
 }
 
 unsigned long get_metapagetable_entry(void *ptr) {
@@ -175,13 +521,162 @@ void deallocate_metapagetable_entries(void *ptr, unsigned long size) {
     }*/
 }
 
+// Objects kept per thread and type before deletes go back to tcmalloc
+#define TYPEDPOOL_MAXOBJECTS 128
+// Terminates the per-thread list of pools, so that a NULL next marks a pool
+// not registered with its thread yet
+#define TYPEDPOOL_LISTEND ((struct metalloc_typed_pool*)1)
+
+extern void *tc_malloc(size_t size) __attribute__((weak));
+extern void *tc_new(size_t size) __attribute__((weak));
+extern void *tc_metalloc_malloc(size_t size, int flags) __attribute__((weak));
+extern void *tc_metalloc_new(size_t size, int flags) __attribute__((weak));
+extern void *_Znwm(size_t size) __attribute__((weak));
+extern void _ZdlPv(void *ptr) __attribute__((weak));
+extern size_t tc_malloc_size(void *ptr) __attribute__((weak));
+
+static void set_object_metadata(void *ptr, unsigned long size, unsigned long typeinfo) {
+    unsigned long entry = get_metapagetable_entry(ptr);
+    // Replacement allocators may hand out memory metalloc does not track
+    if (entry == 0)
+        return;
+    unsigned long *metaptr = (unsigned long*)(metapagetable_entry_base(entry) +
+        metapagetable_entry_index(entry, (unsigned long)ptr) * FLAGS_METALLOC_METADATABYTES);
+    unsigned long count = metapagetable_entry_count(entry, size);
+    for (unsigned long i = 0; i < count; ++i) {
+        metaptr[2 * i] = (unsigned long)ptr;
+        metaptr[2 * i + 1] = typeinfo;
+    }
+}
+
+// Allocation with the final metadata written in a single pass: the metalloc
+// tcmalloc is told not to clear the metadata it would otherwise reset. When
+// malloc is not tcmalloc's, e.g. replaced by the program, the replacement is
+// called and the metadata is written over whatever it left.
+void *metalloc_typed_malloc(unsigned long size, unsigned long typeinfo) {
+    void *ptr;
+    if (tc_metalloc_malloc && (void*)malloc == (void*)tc_malloc)
+        ptr = tc_metalloc_malloc(size, METALLOC_ALLOC_NOCLEAR);
+    else
+        ptr = malloc(size);
+    if (ptr != NULL)
+        set_object_metadata(ptr, size, typeinfo);
+    return ptr;
+}
+
+// As metalloc_typed_malloc, with operator new semantics (new-handler, bad_alloc)
+void *metalloc_typed_new(unsigned long size, unsigned long typeinfo) {
+    void *ptr;
+    if (tc_metalloc_new && (void*)_Znwm == (void*)tc_new)
+        ptr = tc_metalloc_new(size, METALLOC_ALLOC_NOCLEAR);
+    else
+        ptr = _Znwm(size);
+    set_object_metadata(ptr, size, typeinfo);
+    return ptr;
+}
+
+// Pooled objects come from operator new, so they go back through operator delete
+static void typed_pool_release(void *ptr) {
+    if (_ZdlPv)
+        _ZdlPv(ptr);
+    else
+        free(ptr);
+}
+
+// Pools the current thread has cached objects in, drained when it exits
+static __thread struct metalloc_typed_pool *typedPools;
+static pthread_key_t typedPoolKey;
+static pthread_once_t typedPoolKeyOnce = PTHREAD_ONCE_INIT;
+
+static void typed_pool_drain(void *list) {
+    struct metalloc_typed_pool *pool = (struct metalloc_typed_pool*)list;
+    typedPools = NULL;
+    while (pool != TYPEDPOOL_LISTEND) {
+        struct metalloc_typed_pool *next = pool->next;
+        void *ptr = pool->head;
+        pool->head = NULL;
+        pool->count = 0;
+        pool->next = NULL;
+        while (ptr != NULL) {
+            void *nextptr = *(void**)ptr;
+            typed_pool_release(ptr);
+            ptr = nextptr;
+        }
+        pool = next;
+    }
+}
+
+static void typed_pool_key_create(void) {
+    pthread_key_create(&typedPoolKey, typed_pool_drain);
+}
+
+// Pools are thread-local, so the first object cached in one links it into
+// this thread's list. The key value is the list head, which also makes the
+// destructor run again for pools filled by later thread-exit destructors.
+static void typed_pool_register(struct metalloc_typed_pool *pool) {
+    pthread_once(&typedPoolKeyOnce, typed_pool_key_create);
+    pool->next = typedPools ? typedPools : TYPEDPOOL_LISTEND;
+    typedPools = pool;
+    pthread_setspecific(typedPoolKey, pool);
+}
+
+// Type-stable caches for segregated types. Objects in a pool keep the
+// metadata stamped when they entered it, so reusing them writes no metadata.
+// Each pool is a thread-local (head, count, next) triple emitted by
+// TypeSanTreePass for every segregated type; free objects are linked through
+// their first word.
+void *metalloc_typed_pool_new(unsigned long size, unsigned long typeinfo, struct metalloc_typed_pool *pool) {
+    void *ptr = pool->head;
+    if (ptr != NULL) {
+        pool->head = *(void**)ptr;
+        pool->count--;
+        return ptr;
+    }
+    return metalloc_typed_new(size, typeinfo);
+}
+
+// Whether the block at ptr was allocated for a single object of the given
+// size: it holds one but has no room for a second. Unsized deletes also free
+// container buffers of the type, whose blocks are sized for several objects
+// and must not be handed out as one.
+static bool typed_pool_fits(void *ptr, unsigned long size) {
+    size_t blockSize;
+    if (tc_malloc_size && (void*)malloc == (void*)tc_malloc)
+        blockSize = tc_malloc_size(ptr);
+    else
+        blockSize = malloc_usable_size(ptr);
+    return blockSize >= size && blockSize < 2 * size;
+}
+
+void metalloc_typed_pool_delete(void *ptr, unsigned long size, unsigned long typeinfo, struct metalloc_typed_pool *pool) {
+    if (ptr == NULL)
+        return;
+    // Memory without metadata, e.g. from an allocator metalloc does not
+    // track, cannot keep a type and is not cached
+    unsigned long entry = get_metapagetable_entry(ptr);
+    if (unlikely(entry == 0 || pool->count >= TYPEDPOOL_MAXOBJECTS || !typed_pool_fits(ptr, size))) {
+        typed_pool_release(ptr);
+        return;
+    }
+    // Objects allocated outside the pool need their metadata stamped once
+    unsigned long *metaptr = (unsigned long*)(metapagetable_entry_base(entry) +
+        metapagetable_entry_index(entry, (unsigned long)ptr) * FLAGS_METALLOC_METADATABYTES);
+    if (unlikely(metaptr[0] != (unsigned long)ptr || metaptr[1] != typeinfo))
+        set_object_metadata(ptr, size, typeinfo);
+    if (unlikely(pool->next == NULL))
+        typed_pool_register(pool);
+    *(void**)ptr = pool->head;
+    pool->head = ptr;
+    pool->count++;
+}
+
 /* TODO this is a bad hack to prevent the system from crashing if Firefox does casts on stack objects that should never have been typecast in the first place */
 __attribute__((constructor)) static void allocate_safe_stack_meta(void) {
 	char *stackend = (char *) 0x0000800000000000UL;
 	size_t stacksize = 0x100000;
 	char *stackstart = stackend - stacksize;
 	int alignbits = 3;
-	void *metadata = allocate_metadata(stacksize, alignbits);
+	void *metadata = allocate_category_metadata(stacksize, alignbits, METALLOC_USAGE_SAFESTACK);
 	set_metapagetable_entries((void *) stackstart, stacksize, metadata, alignbits);
 }
 
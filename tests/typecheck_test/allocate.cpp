@@ -52,7 +52,54 @@ void allocate(int count) {
         checkcast(getbaseptr(ptr));
     }
 }
+#elif defined(ALLOC_THREAD_LOCAL)
+#include <pthread.h>
+thread_local AllocType threadlocal;
+static void *checkthreadlocal(void *arg) {
+    AllocType *ptr = &threadlocal;
+    checkcast(getbaseptr(ptr));
+    return arg;
+}
+void allocate(int count) {
+    // Both the initial thread's copy and the copy of a later thread
+    checkthreadlocal(NULL);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, checkthreadlocal, NULL) != 0) {
+        exit(-1);
+    }
+    pthread_join(thread, NULL);
+}
+#elif defined(ALLOC_DLOPEN)
+#include <dlfcn.h>
+void allocate(int count) {
+    // Unloading the library before any check drops its class hierarchy
+    void *handle = dlopen("./libdlmodule.so", RTLD_NOW);
+    if (handle == NULL || dlclose(handle) != 0) {
+        exit(-1);
+    }
+    handle = dlopen("./libdlmodule.so", RTLD_NOW);
+    if (handle == NULL) {
+        exit(-1);
+    }
+    AllocType *(*dl_allocate)() = (AllocType *(*)())dlsym(handle, "dl_allocate");
+    void (*dl_checkcast)(BaseType *) = (void (*)(BaseType *))dlsym(handle, "dl_checkcast");
+    if (dl_allocate == NULL || dl_checkcast == NULL) {
+        exit(-1);
+    }
+    AllocType *ptr = dl_allocate();
+    dl_checkcast(getbaseptr(ptr));
+    checkcast(getbaseptr(ptr));
+    delete ptr;
+    dlclose(handle);
+}
 #else
+#ifdef ALLOC_NEW_DELETE
+#include <vector>
+#endif
+#ifdef ALLOC_PLACEMENT_NEW
+// Arena memory that only gets a type through placement new
+alignas(AllocType) static char arena[sizeof(AllocType)];
+#endif
 void allocate(int count) {
 #ifdef ALLOC_STACK
     AllocType stack;
@@ -176,6 +223,20 @@ void allocate(int count) {
     {
         AllocType *ptr = new AllocType();
 #endif
+#ifdef ALLOC_PLACEMENT_NEW
+    {
+        AllocType *ptr = new (arena) AllocType();
+#endif
+#ifdef ALLOC_NEW_DELETE
+    // Deleted objects are reused with -typesan-segregate-types, while
+    // container buffers of the type freed alongside them must not be
+    for (int i = 0; i < 4; ++i) {
+        std::vector<AllocType> buffer(count);
+        delete new AllocType();
+    }
+    {
+        AllocType *ptr = new AllocType();
+#endif
 #if defined(ALLOC_NEW_ARRAY) || defined(ALLOC_OVERLOADED_NEW_ARRAY)
     AllocType *heap = new AllocType[10];
 #ifndef DO_PASSING
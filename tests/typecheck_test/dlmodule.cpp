@@ -0,0 +1,16 @@
+#include <stdlib.h>
+
+#include "types.h"
+
+// Loaded at run time by the DLOPEN allocation type, so that both the object
+// and the class hierarchy used to check casts on it come from this library
+
+extern "C" AllocType *dl_allocate() {
+    return new AllocType();
+}
+
+extern "C" void dl_checkcast(BaseType *ptr) {
+    if (static_cast<CAST_TYPE*>(ptr) == NULL) {
+        exit(-1);
+    }
+}
@@ -6,12 +6,18 @@
 # Reproduce individual failed test using: COMPILER -O0 -std=c++11 typecheck.cpp -DALLOC_REPORTEDALLOCTYPE -DALLOC_REPORTEDLAYOUTTYPE -DCAST_REPORTEDCASTTYPE SANITIZER_ARGS
 # Add -DDO_PASSING for false positives
 
+import os
 import sys
 import subprocess
 
 # Compile program with given settings
 def compile(compiler, compileArgs, allocOption, baseOption, castOption):
-    args  = [compiler, "-O0", "-std=c++11", "firstmodule.cpp", "typecheck.cpp", "allocate.cpp", "secondmodule.cpp", "-DALLOC_" + allocOption, "-DBASE_" + baseOption, "-DCAST_" + castOption]
+    options = ["-pthread", "-DALLOC_" + allocOption, "-DBASE_" + baseOption, "-DCAST_" + castOption]
+    # The library loaded at run time by DLOPEN
+    if allocOption == "DLOPEN":
+        subprocess.call([compiler, "-O0", "-std=c++11", "-shared", "-fPIC", "-o", "libdlmodule.so", "dlmodule.cpp"] + options + compileArgs);
+        options.append("-ldl")
+    args  = [compiler, "-O0", "-std=c++11", "firstmodule.cpp", "typecheck.cpp", "allocate.cpp", "secondmodule.cpp"] + options
     args.extend(compileArgs)
     subprocess.call(args);
 
@@ -53,16 +59,36 @@ def testConfiguration(compiler, compileArgs, allocOption, baseOption, castOption
         passesTest = False
     return passesTest
 
+# Check that TypeSan reports a bad cast and keeps running without halt_on_error
+def testReports(compiler, compileArgs):
+    compile(compiler, compileArgs, "NEW", "BASIC", "BASIC")
+    env = dict(os.environ)
+    env["TYPESAN_OPTIONS"] = "halt_on_error=0"
+    try:
+        output = subprocess.check_output(["./a.out"], stderr=subprocess.STDOUT, env=env);
+    except subprocess.CalledProcessError:
+        print "Bad casts not reported without halt_on_error (process failed)"
+        return False
+    if not '"kind":"bad_cast"' in output:
+        print "Bad casts not reported without halt_on_error"
+        return False
+    return True
+
 # Options used in typecheck.cpp
-allocOptions = ["STACK", "STACK_ARRAY", "STACK_ARRAY_DEEP", "MALLOC", "MALLOC_ARRAY", "MALLOC_VLA", "CALLOC_ARRAY", "CALLOC_VLA", "REALLOC", "REALLOC_ARRAY", "REALLOC_VLA", "NEW", "NEW_ARRAY", "NEW_VLA", "OVERLOADED_NEW", "OVERLOADED_NEW_ARRAY", "OVERLOADED_NEW_VLA", "GLOBAL", "GLOBAL_ARRAY", "GLOBAL_ARRAY_DEEP", "ARGUMENT"]
+allocOptions = ["STACK", "STACK_ARRAY", "STACK_ARRAY_DEEP", "MALLOC", "MALLOC_ARRAY", "MALLOC_VLA", "CALLOC_ARRAY", "CALLOC_VLA", "REALLOC", "REALLOC_ARRAY", "REALLOC_VLA", "NEW", "NEW_ARRAY", "NEW_VLA", "NEW_DELETE", "OVERLOADED_NEW", "OVERLOADED_NEW_ARRAY", "OVERLOADED_NEW_VLA", "PLACEMENT_NEW", "DLOPEN", "GLOBAL", "GLOBAL_ARRAY", "GLOBAL_ARRAY_DEEP", "THREAD_LOCAL", "ARGUMENT"]
 baseOptions = ["BASIC", "NESTED0", "NESTED", "NESTED_MIXED", "NESTED_ARRAY", "NESTED_DEEP", "NESTED_ARRAY_DEEP", "INHERITANCE", "VINHERITANCE", "INHERITANCE_MULTI", "VINHERITANCE_MULTI", "INHERITANCE_MULTI_DEEP", "VINHERITANCE_MULTI_DEEP"]
 castOptions = ["BASIC", "INHERITANCE_MULTI", "PHANTOM", "PHANTOM_DEEP"]
 
 # Allocation options that support virtual objects
-virtualAllocOptions = ["STACK", "STACK_ARRAY", "STACK_ARRAY_DEEP", "NEW", "NEW_ARRAY", "NEW_VLA", "OVERLOADED_NEW", "OVERLOADED_NEW_ARRAY", "OVERLOADED_NEW_VLA", "GLOBAL", "GLOBAL_ARRAY", "GLOBAL_ARRAY_DEEP", "ARGUMENT"]
+virtualAllocOptions = ["STACK", "STACK_ARRAY", "STACK_ARRAY_DEEP", "NEW", "NEW_ARRAY", "NEW_VLA", "NEW_DELETE", "OVERLOADED_NEW", "OVERLOADED_NEW_ARRAY", "OVERLOADED_NEW_VLA", "PLACEMENT_NEW", "DLOPEN", "GLOBAL", "GLOBAL_ARRAY", "GLOBAL_ARRAY_DEEP", "THREAD_LOCAL", "ARGUMENT"]
 # Structure layouts using virtual inheritance
 virtualBaseOptions = ["VINHERITANCE", "VINHERITANCE_MULTI", "VINHERITANCE_MULTI_DEEP"]
 
+if "-fsanitize=typesan" in sys.argv[2:]:
+    testReports(sys.argv[1], sys.argv[2:])
+    # Type-segregated heap, where deleted objects are cached per type
+    testConfiguration(sys.argv[1], sys.argv[2:] + ["-mllvm", "-typesan-segregate-types"], "NEW_DELETE", None, None, "Segregated allocations of type {ALLOC} not handled")
+
 # Check different allocation types with basic options
 unhandledAllocOptions = set()
 for allocOption in allocOptions:
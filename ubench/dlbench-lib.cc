@@ -0,0 +1,20 @@
+class DlBaseClass {
+public:
+	virtual ~DlBaseClass() {}
+	long value;
+};
+
+class DlDerivedClass : public DlBaseClass {
+public:
+	long members[8];
+};
+
+/* tracked globals in both writable and read-only data */
+DlDerivedClass dlbench_global;
+DlDerivedClass dlbench_globals[16];
+const DlBaseClass dlbench_const_global = DlBaseClass();
+
+extern "C" void *dlbench_touch(void) {
+	DlBaseClass *base = &dlbench_globals[1];
+	return static_cast<DlDerivedClass *>(base);
+}
@@ -0,0 +1,83 @@
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+#ifndef DLBENCH_COUNT
+#define DLBENCH_COUNT 256
+#endif
+#ifndef DLBENCH_DIR
+#define DLBENCH_DIR "dlbench-libs"
+#endif
+
+#define ITERCOUNT 16
+
+volatile void *globalptr;
+
+static inline uint64_t rdtsc(void) {
+	uint32_t eax, edx;
+	__asm volatile ("rdtsc" : "=a" (eax), "=d" (edx));
+	return eax | ((uint64_t) edx << 32);
+}
+
+static void report(const char *desc, int count, double tsc) {
+	printf("%s\t%d\t%.1f\n", desc, count, tsc / count);
+}
+
+static void report_rss(const char *desc, int count) {
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	printf("%s\t%d\t%ld\n", desc, count, usage.ru_maxrss);
+}
+
+/* dlopen the first count libraries, cast once through each, then dlclose
+ * them again; reports cycles per library for each phase
+ */
+static void test_dlopen(int count) {
+	static void *handles[DLBENCH_COUNT];
+	char path[256];
+	uint64_t tscopen = 0, tsctouch = 0, tscclose = 0, tscstart;
+	int i, iter;
+
+	for (iter = 0; iter < ITERCOUNT; iter++) {
+		tscstart = rdtsc();
+		for (i = 0; i < count; i++) {
+			snprintf(path, sizeof(path), "./" DLBENCH_DIR "/libdlbench-%d.so", i);
+			handles[i] = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+			if (!handles[i]) {
+				fprintf(stderr, "dlopen failed: %s\n", dlerror());
+				exit(1);
+			}
+		}
+		tscopen += rdtsc() - tscstart;
+
+		tscstart = rdtsc();
+		for (i = 0; i < count; i++) {
+			void *(*touch)(void) = (void *(*)(void)) dlsym(handles[i], "dlbench_touch");
+			globalptr = touch();
+		}
+		tsctouch += rdtsc() - tscstart;
+
+		tscstart = rdtsc();
+		for (i = count - 1; i >= 0; i--) {
+			dlclose(handles[i]);
+		}
+		tscclose += rdtsc() - tscstart;
+	}
+	report("dlopen_cycles", count, (double) tscopen / ITERCOUNT);
+	report("dltouch_cycles", count, (double) tsctouch / ITERCOUNT);
+	report("dlclose_cycles", count, (double) tscclose / ITERCOUNT);
+	report_rss("maxrss_kb_dlopen", count);
+}
+
+int main(void) {
+	int count;
+
+	printf("desc\tcount\tvalue\n");
+	for (count = 1; count <= DLBENCH_COUNT; count *= 2) {
+		test_dlopen(count);
+	}
+	return 0;
+}
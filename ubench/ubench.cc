@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 
 #define ITERCOUNT 1024
@@ -14,6 +15,14 @@ static double cpu_freq;
 volatile void *globalptr;
 static int objcountlog;
 
+/* Segregated-type caches from libmetapagetable and the tcmalloc thread cache
+ * behind them; only present when linked against the metalloc tcmalloc
+ */
+extern "C" void *metalloc_typed_pool_new(unsigned long size, unsigned long typeinfo, void *pool) __attribute__((weak));
+extern "C" void metalloc_typed_pool_delete(void *ptr, unsigned long size, unsigned long typeinfo, void *pool) __attribute__((weak));
+extern "C" void *tc_new(size_t size) __attribute__((weak));
+extern "C" void tc_delete(void *ptr) __attribute__((weak));
+
 static inline uint64_t rdtsc(void) {
 	uint32_t eax, edx;
 	__asm volatile ("rdtsc" : "=a" (eax), "=d" (edx));
@@ -107,6 +116,13 @@ static void measure_report(
 		tscdiff[ITERCOUNT - 1] * factor);
 }
 
+static void report_rss(const char *desc) {
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	printf("%s\t\t\t%d\t\t%ld\t\t\t\t\t\t\n", desc, objcountlog, usage.ru_maxrss);
+}
+
 #define MEASURE(desc, logsize, nested, code1, code2, code3)		\
 	do {								\
 		int i, j;						\
@@ -183,6 +199,42 @@ static void test_alloc_heap(void) {
 #undef TESTSIZE
 }
 
+/* Allocate and immediately free one object at a time, the pattern where a
+ * type cache hands back the object it just took; compares the segregated-type
+ * cache against the tcmalloc thread cache it falls back on
+ */
+#define TESTSIZE(logsize, nested, class) 				\
+static void test_churn_heap_##logsize##_##nested(void) { 		\
+	static __thread unsigned long pool[3];				\
+	MEASURE("churn_pool", logsize, nested,	 			\
+		int loop;						\
+	,								\
+		for (loop = 0; loop < LOOPCOUNT; loop++) {		\
+			void *obj = metalloc_typed_pool_new(sizeof(class), 0, pool); \
+			globalptr = obj;				\
+			metalloc_typed_pool_delete(obj, sizeof(class), 0, pool); \
+		}							\
+	, {});								\
+	MEASURE("churn_tcmalloc", logsize, nested, 			\
+		int loop;						\
+	,								\
+		for (loop = 0; loop < LOOPCOUNT; loop++) {		\
+			void *obj = tc_new(sizeof(class));		\
+			globalptr = obj;				\
+			tc_delete(obj);					\
+		}							\
+	, {});								\
+}
+#include "ubench-gen-inc.h"
+#undef TESTSIZE
+
+static void test_churn_heap(void) {
+	if (!metalloc_typed_pool_new || !tc_new) return;
+#define TESTSIZE(logsize, nested, class) test_churn_heap_##logsize##_##nested();
+#include "ubench-gen-inc.h"
+#undef TESTSIZE
+}
+
 #define TESTSIZE(logsize, nested, class) 				\
 static void test_cast_stack_##logsize##_##nested(void) { 		\
 	MEASURE("cast_stack", logsize, nested, 				\
@@ -251,6 +303,8 @@ static void test_recurse(int objcount) {
 	if (objcount == (1 << objcountlog)) {
 		test_alloc_stack();
 		test_alloc_heap();
+		report_rss("maxrss_kb_alloc_heap");
+		test_churn_heap();
 		test_cast_stack();
 		test_cast_heap();
 		objcountlog++;